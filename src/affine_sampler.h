@@ -174,6 +174,7 @@ public:
 	void set_sigma_min(double _sigma_min);
 	void flush(bool record_steps=true);		// Clear the weights in the ensemble and record the outstanding component states
 	void clear();					// Clear the stats, acceptance information and weights
+	void recompute_pdf();				// Re-evaluate pdf(X) of the ensemble (e.g., after <params> has changed)
 	
 	void init_gaussian_mixture_target(unsigned int nclusters, unsigned int iterations=100);
 	
@@ -246,6 +247,7 @@ public:
 	void set_sigma_min(double _sigma_min) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_sigma_min(_sigma_min); } };
 	void init_gaussian_mixture_target(unsigned int nclusters, unsigned int iterations=100) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->init_gaussian_mixture_target(nclusters, iterations); } };
 	void clear() { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->clear(); }; stats.clear(); };
+	void recompute_pdf();	// Re-evaluate pdf(X) of every ensemble (e.g., after <params> has changed)
 	
 	// Accessors
 	TLogger& get_logger() { return logger; }
@@ -1324,6 +1326,19 @@ void TAffineSampler<TParams, TLogger>::clear() {
 	N_custom_rejected = 0;
 }
 
+// Re-evaluate the probability density of each state in the ensemble, and
+// find the most likely state again. Needed when the target distribution
+// changes (e.g., <params> is modified) partway through sampling.
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::recompute_pdf() {
+	unsigned int index_of_best = 0;
+	for(unsigned int i=0; i<L; i++) {
+		X[i].pi = pdf(X[i].element, N, params);
+		if(X[i] > X[index_of_best]) { index_of_best = i; }
+	}
+	X_ML = X[index_of_best];
+}
+
 
 
 /*************************************************************************
@@ -1468,6 +1483,14 @@ void TParallelAffineSampler<TParams, TLogger>::step_MH(unsigned int N_steps, boo
 	Gelman_Rubin_diagnostic(component_stats, N_samplers, R, N);
 }
 
+template<class TParams, class TLogger>
+void TParallelAffineSampler<TParams, TLogger>::recompute_pdf() {
+	#pragma omp parallel for schedule(dynamic)
+	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
+		sampler[sampler_num]->recompute_pdf();
+	}
+}
+
 template<class TParams, class TLogger>
 void TParallelAffineSampler<TParams, TLogger>::step_custom_reversible(unsigned int N_steps,
 	                                                              typename TAffineSampler<TParams, TLogger>::reversible_step_t f_reversible_step,
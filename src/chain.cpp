@@ -465,6 +465,8 @@ void TChain::fit_gaussian_mixture(TGaussianMixture *gm, unsigned int iterations)
 bool TChain::save(std::string fname, std::string group_name, size_t index,
                   std::string dim_name, int compression, int subsample,
                   bool converged, float lnZ) const {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
 	if((compression<0) || (compression > 9)) {
 		std::cerr << "! Invalid gzip compression level: " << compression << std::endl;
 		return false;
@@ -728,7 +730,10 @@ void TChain::get_image(cv::Mat& mat, const TRect& grid, unsigned int dim1, unsig
                        bool norm, double sigma1, double sigma2, double nsigma, bool sigma_pix_units) const {
 	assert((dim1 >= 0) && (dim1 < N) && (dim2 >= 0) && (dim2 < N) && (dim1 != dim2));
 
-	mat = cv::Mat::zeros(grid.N_bins[0], grid.N_bins[1], CV_FLOATING_TYPE);
+	// Write into <mat> in place, if it already has the right shape, so
+	// that views (e.g., into a TImgStack) remain valid
+	mat.create(grid.N_bins[0], grid.N_bins[1], CV_FLOATING_TYPE);
+	mat.setTo(0);
 
 	//std::cout << grid.N_bins[0] << " " << grid.N_bins[1] << std::endl;
 
@@ -837,6 +842,8 @@ void TImgWriteBuffer::add(const cv::Mat& img) {
 }
 
 void TImgWriteBuffer::write(const std::string& fname, const std::string& group, const std::string& img) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
 	H5::H5File* h5file = H5Utils::openFile(fname);
 	H5::Group* h5group = H5Utils::openGroup(h5file, group);
 
@@ -921,21 +928,54 @@ void TChainWriteBuffer::add(const TChain& chain, bool converged, double lnZ,
 		std::cout << "reserving" << std::endl;
 	}
 
+	metadata.push_back(TChainMetadata());
+	fill_slot(length_, chain, r, samplePos, converged, lnZ, GR, subsample);
+
+	length_++;
+}
+
+void TChainWriteBuffer::resize(unsigned int length) {
+	if(length > nReserved_) { reserve(length); }
+
+	TChainMetadata empty = {false, std::numeric_limits<float>::quiet_NaN()};
+	metadata.resize(length, empty);
+
+	// Slots that are never filled are written out as NaN
+	if(length > length_) {
+		std::fill(buf + length_ * nDim_ * (nSamples_+2),
+		          buf + length * nDim_ * (nSamples_+2),
+		          std::numeric_limits<float>::quiet_NaN());
+	}
+
+	length_ = length;
+}
+
+void TChainWriteBuffer::set(unsigned int idx, const TChain& chain, gsl_rng *r_subsample,
+                            bool converged, double lnZ, double * GR, bool subsample) {
+	assert(idx < length_);
+
+	std::vector<double> sample_pos(nSamples_, 0);
+	fill_slot(idx, chain, r_subsample, sample_pos, converged, lnZ, GR, subsample);
+}
+
+void TChainWriteBuffer::fill_slot(unsigned int idx, const TChain& chain,
+                                  gsl_rng *r_subsample, std::vector<double> &sample_pos,
+                                  bool converged, double lnZ, double * GR, bool subsample) {
 	// Store metadata
 	TChainMetadata meta = {converged, (float)lnZ};
-	metadata.push_back(meta);
+	metadata[idx] = meta;
 
 	const double *chainElement;
 	unsigned int chainLength = chain.get_length();
-	size_t start_idx = length_ * nDim_ * (nSamples_+2);
+	size_t start_idx = (size_t)idx * nDim_ * (nSamples_+2);
 
 	if(subsample) {	// Choose random subsample of points to add
 		// Choose which points in chain to sample
 		double totalWeight = chain.get_total_weight();
 		for(unsigned int i=0; i<nSamples_; i++) {
-			samplePos[i] = gsl_rng_uniform(r) * totalWeight;
+			sample_pos[i] = gsl_rng_uniform(r_subsample) * totalWeight;
 		}
-		std::sort(samplePos.begin(), samplePos.end());
+		std::sort(sample_pos.begin(), sample_pos.end());
 
 		// Copy chosen points into buffer
 		unsigned int i = 1;	// Position in chain
@@ -943,7 +983,7 @@ void TChainWriteBuffer::add(const TChain& chain, bool converged, double lnZ,
 		double w = chain.get_w(0);
 		//size_t start_idx = length_ * nDim_ * (nSamples_+2);
 		while(k < nSamples_) {
-			if(w < samplePos[k]) {
+			if(w < sample_pos[k]) {
 				assert(i < chainLength);
 				w += chain.get_w(i);
 				i++;
@@ -1009,11 +1049,11 @@ void TChainWriteBuffer::add(const TChain& chain, bool converged, double lnZ,
 	}
 
 	//std::cout << "Done." << std::endl;
-
-	length_++;
 }
 
 void TChainWriteBuffer::write(const std::string& fname, const std::string& group, const std::string& chain, const std::string& meta) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
 	H5::H5File* h5file = H5Utils::openFile(fname);
 	H5::Group* h5group = H5Utils::openGroup(h5file, group);
 
@@ -1467,6 +1507,8 @@ void TGaussianMixture::print() {
 
 bool save_mat_image(cv::Mat& img, TRect& rect, std::string fname, std::string group_name,
                     std::string dset_name, std::string dim1, std::string dim2, int compression) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
 	assert((img.dims == 2) && (img.rows == rect.N_bins[0]) && (img.cols == rect.N_bins[1]));
 
 	if((compression<0) || (compression > 9)) {
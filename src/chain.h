@@ -236,6 +236,19 @@ public:
 		     double * GR = NULL,
 			 bool subsample = true);
 
+	// Set the number of chains in the buffer. The slots can then be
+	// filled in any order using set().
+	void resize(unsigned int length);
+
+	// Store a chain in slot <idx>. Different slots may be filled
+	// concurrently, as long as each thread passes in its own random
+	// number generator (used for subsampling the chain).
+	void set(unsigned int idx, const TChain &chain, gsl_rng *r_subsample,
+	         bool converged = true,
+	         double lnZ = std::numeric_limits<double>::quiet_NaN(),
+	         double * GR = NULL,
+	         bool subsample = true);
+
 	void reserve(unsigned int nReserved);
 
 	void write(const std::string& fname, const std::string& group,
@@ -247,6 +260,10 @@ private:
 	gsl_rng *r;
 	std::vector<double> samplePos;
 
+	void fill_slot(unsigned int idx, const TChain &chain,
+	               gsl_rng *r_subsample, std::vector<double> &sample_pos,
+	               bool converged, double lnZ, double *GR, bool subsample);
+
 	struct TChainMetadata {
 		bool converged;
 		float lnZ;
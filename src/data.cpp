@@ -56,6 +56,8 @@ TStellarData::TStellarData(uint64_t _healpix_index, uint32_t _nside, bool _neste
 
 
 bool TStellarData::save(const std::string& fname, const std::string& group, const std::string &dset, int compression) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
 	if((compression < 0) || (compression > 9)) {
 		std::cerr << "! Invalid gzip compression level: " << compression << std::endl;
 		return false;
@@ -199,6 +201,8 @@ void TStellarData::TMagnitudes::set(const TStellarData::TFileData& dat, double e
 
 bool TStellarData::load(const std::string& fname, const std::string& group, const std::string& dset,
 			double err_floor, double default_EBV) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
 	H5::H5File *file = H5Utils::openFile(fname);
 	if(file == NULL) { return false; }
 
@@ -733,6 +737,8 @@ herr_t fetch_pixel_name(hid_t loc_id, const char *name, void *opdata) {
 }
 
 void get_input_pixels(std::string fname, std::vector<std::string> &pix_name) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
 	H5::H5File *file = H5Utils::openFile(fname, H5Utils::READ);
 
 	file->iterateElems("/photometry/", NULL, fetch_pixel_name, reinterpret_cast<void*>(&pix_name));
@@ -740,6 +746,27 @@ void get_input_pixels(std::string fname, std::vector<std::string> &pix_name) {
 	delete file;
 }
 
+void get_input_pixel_sizes(std::string fname, const std::vector<std::string> &pix_name,
+                           std::vector<size_t> &n_stars) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
+	H5::H5File *file = H5Utils::openFile(fname, H5Utils::READ);
+
+	n_stars.clear();
+	n_stars.reserve(pix_name.size());
+
+	// Only the dataset shapes are read, not the photometry itself
+	for(std::vector<std::string>::const_iterator it = pix_name.begin(); it != pix_name.end(); ++it) {
+		H5::DataSet dataset = file->openDataSet("/photometry/" + *it);
+		H5::DataSpace dspace = dataset.getSpace();
+		hsize_t length;
+		dspace.getSimpleExtentDims(&length);
+		n_stars.push_back(length);
+	}
+
+	delete file;
+}
+
 
 /*************************************************************************
  *
@@ -162,5 +162,9 @@ void draw_from_emp_model(size_t nstars, double RV, TGalacticLOSModel& gal_model,
 // Return healpix indices of pixels in input file
 void get_input_pixels(std::string fname, std::vector<std::string> &pix_name);
 
+// Return the # of stars in each of the given pixels of the input file
+void get_input_pixel_sizes(std::string fname, const std::vector<std::string> &pix_name,
+                           std::vector<size_t> &n_stars);
+
 
 #endif // _STELLAR_DATA_H__
@@ -32,6 +32,69 @@ int H5Utils::READ = 1;
 int H5Utils::WRITE = (1 << 1);
 int H5Utils::DONOTCREATE = (1 << 2);
 
+std::recursive_mutex H5Utils::io_mutex;
+
+
+/*
+ * File session
+ *
+ * The open file and groups are kept here, rather than in the session
+ * object, so that openFile() and openGroup() can find them.
+ *
+ */
+
+namespace {
+	std::string session_fname;
+	H5::H5File *session_file = NULL;
+	std::map<std::string, H5::Group> session_groups;
+	
+	bool in_session(H5::H5File *file) {
+		return (session_file != NULL) && (file->getId() == session_file->getId());
+	}
+}
+
+H5Utils::TFileSession::TFileSession(const std::string &fname) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+	
+	if(session_file != NULL) {
+		std::cerr << "TFileSession: A session is already open on "
+		          << session_fname << "." << std::endl;
+		return;
+	}
+	
+	session_file = H5Utils::openFile(fname);
+	if(session_file != NULL) { session_fname = fname; }
+}
+
+H5Utils::TFileSession::~TFileSession() {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+	
+	if(session_file == NULL) { return; }
+	
+	// Handles still held elsewhere keep the file open until they are closed
+	session_groups.clear();
+	delete session_file;
+	session_file = NULL;
+	session_fname.clear();
+}
+
+bool H5Utils::TFileSession::is_open() const {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+	return session_file != NULL;
+}
+
+void H5Utils::flush_session() {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+	
+	if(session_file == NULL) { return; }
+	
+	session_file->flush(H5F_SCOPE_LOCAL);
+	
+	// Keeps the number of open handles bounded over a long run
+	session_groups.clear();
+}
+
+
 /* 
  * Opens a file, creating it if it does not exist.
  * 
@@ -53,6 +116,14 @@ int H5Utils::DONOTCREATE = (1 << 2);
 H5::H5File* H5Utils::openFile(const std::string& fname, int accessmode) {
 	H5::H5File* file = NULL;
 	
+	// Share the file held open by the session
+	{
+		std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+		if((session_file != NULL) && (fname == session_fname)) {
+			return new H5::H5File(*session_file);
+		}
+	}
+	
 	// Read/Write access
 	if((accessmode & H5Utils::READ) && (accessmode & H5Utils::WRITE)) {
 		try {
@@ -92,6 +163,18 @@ H5::H5File* H5Utils::openFile(const std::string& fname, int accessmode) {
 H5::Group* H5Utils::openGroup(H5::H5File* file, const std::string& name, int accessmode) {
 	H5::Group* group = NULL;
 	
+	// Share groups already opened in the session's file
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+	bool cache = false;
+	if(in_session(file)) {
+		std::map<std::string, H5::Group>::iterator it = session_groups.find(name);
+		if(it != session_groups.end()) {
+			return new H5::Group(it->second);
+		}
+		// Groups that may later be unlinked are not cached
+		cache = !(accessmode & H5Utils::DONOTCREATE);
+	}
+	
 	// User does not want to create group
 	if(accessmode & H5Utils::DONOTCREATE) {
 		try {
@@ -115,6 +198,10 @@ H5::Group* H5Utils::openGroup(H5::H5File* file, const std::string& name, int acc
 		}
 	}
 	
+	if(cache && (group != NULL)) {
+		session_groups.insert(std::make_pair(name, *group));
+	}
+	
 	return group;
 }
 
@@ -293,36 +380,42 @@ bool add_watermark_helper(const std::string &filename, const std::string &group_
 
 template<>
 bool H5Utils::add_watermark<bool>(const std::string &filename, const std::string &group_name, const std::string &attribute_name, const bool &value) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
 	H5::DataType dtype = H5::PredType::NATIVE_UCHAR;
 	return add_watermark_helper<bool>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<float>(const std::string &filename, const std::string &group_name, const std::string &attribute_name, const float &value) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
 	H5::DataType dtype = H5::PredType::NATIVE_FLOAT;
 	return add_watermark_helper<float>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<double>(const std::string &filename, const std::string &group_name, const std::string &attribute_name, const double &value) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
 	H5::DataType dtype = H5::PredType::NATIVE_DOUBLE;
 	return add_watermark_helper<double>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<uint32_t>(const std::string &filename, const std::string &group_name, const std::string &attribute_name, const uint32_t &value) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
 	H5::DataType dtype = H5::PredType::NATIVE_UINT32;
 	return add_watermark_helper<uint32_t>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<uint64_t>(const std::string &filename, const std::string &group_name, const std::string &attribute_name, const uint64_t &value) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
 	H5::DataType dtype = H5::PredType::NATIVE_UINT64;
 	return add_watermark_helper<uint64_t>(filename, group_name, attribute_name, value, &dtype);
 }
 
 template<>
 bool H5Utils::add_watermark<std::string>(const std::string &filename, const std::string &group_name, const std::string &attribute_name, const std::string &value) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
 	H5::StrType strtype(0, H5T_VARIABLE);
 	H5::DataSpace dspace(H5S_SCALAR);
 	return add_watermark_helper<std::string>(filename, group_name, attribute_name, value, NULL, &strtype, dspace);
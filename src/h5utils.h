@@ -32,6 +32,8 @@
 #include <iostream>
 #include <string.h>
 #include <sstream>
+#include <mutex>
+#include <map>
 #include <H5Cpp.h>
 
 namespace H5Utils {
@@ -40,6 +42,29 @@ namespace H5Utils {
 	extern int WRITE;
 	extern int DONOTCREATE;
 	
+	// The HDF5 library is not thread-safe. Any code that touches
+	// HDF5 while other threads may be running (e.g., when several
+	// pixels are processed concurrently) must hold this lock.
+	extern std::recursive_mutex io_mutex;
+	
+	// Keeps one file, and every group opened in it, open for as long as
+	// the session exists. While it does, openFile() and openGroup() hand
+	// out new handles to the already-open file and groups, rather than
+	// reopening them, so code that opens the file for each dataset or
+	// attribute it writes does not pay for it. Only one session may be
+	// open at a time.
+	class TFileSession {
+	public:
+		TFileSession(const std::string &fname);
+		~TFileSession();
+		
+		bool is_open() const;
+	};
+	
+	// Write all buffered data in the session's file to disk, and release
+	// the cached groups. Does nothing if no session is open.
+	void flush_session();
+	
 	H5::H5File* openFile(const std::string &fname, int accessmode = (READ | WRITE));
 	H5::Group* openGroup(H5::H5File* file, const std::string &name, int accessmode = 0);
 	H5::DataSet* openDataSet(H5::H5File* file, const std::string &name);
@@ -26,6 +26,12 @@
 
 #include "los_sampler.h"
 
+// Hand-vectorized kernels, chosen at run time (see los_integral)
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__) && !defined(__INTEL_COMPILER)
+#define LOS_INTEGRAL_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
 
 /*
  *  Test l.o.s. fits
@@ -34,6 +40,8 @@
 void test_extinction_profiles(TLOSMCMCParams &params) {
 	bool exit = false;
 
+	params.img_stack->build_cumsum();
+
 	while(!exit) {
 		std::string response;
 		std::string yn;
@@ -107,10 +115,16 @@ void test_extinction_profiles(TLOSMCMCParams &params) {
 
 void sample_los_extinction_clouds(const std::string& out_fname, const std::string& group_name,
                                   TMCMCOptions &options, TLOSMCMCParams &params,
-                                  unsigned int N_clouds, int verbosity) {
+                                  unsigned int N_clouds, int verbosity,
+                                  TWriteQueue *write_queue) {
 	timespec t_start, t_write, t_end;
 	clock_gettime(CLOCK_MONOTONIC, &t_start);
 
+	// Cloud line integrals are differences of cumulative sums along rows
+	// of each star's image
+	params.img_stack->set_layout(TImgStack::LAYOUT_IMAGES);
+	params.img_stack->build_cumsum();
+
 	/*double x[] = {8., 4., -0.693, -1.61};
 	gsl_rng *r;
 	seed_gsl_rng(&r);
@@ -225,6 +239,8 @@ void sample_los_extinction_clouds(const std::string& out_fname, const std::strin
 		}
 	}
 
+	params.img_stack->clear_cumsum();
+
 	clock_gettime(CLOCK_MONOTONIC, &t_write);
 
 	//std::stringstream group_name;
@@ -236,9 +252,9 @@ void sample_los_extinction_clouds(const std::string& out_fname, const std::strin
 	group_name_full << "/" << group_name;
 	TChain chain = sampler.get_chain();
 
-	TChainWriteBuffer writeBuffer(ndim, 100, 1);
-	writeBuffer.add(chain, converged, std::numeric_limits<double>::quiet_NaN(), GR_transf.data());
-	writeBuffer.write(out_fname, group_name_full.str(), "clouds");
+	std::shared_ptr<TChainWriteBuffer> writeBuffer = std::make_shared<TChainWriteBuffer>(ndim, 100, 1);
+	writeBuffer->add(chain, converged, std::numeric_limits<double>::quiet_NaN(), GR_transf.data());
+	queue_write(write_queue, writeBuffer, out_fname, group_name_full.str(), "clouds");
 
 	clock_gettime(CLOCK_MONOTONIC, &t_end);
 
@@ -266,6 +282,11 @@ void los_integral_clouds(
         const double *const logDelta_EBV,
 		unsigned int N_clouds)
 {
+	assert(img_stack.layout == TImgStack::LAYOUT_IMAGES);
+	assert(img_stack.cumsum != NULL);
+
+	const size_t row_stride = img_stack.rect->N_bins[1] + 1;
+
 	int x = 0;
 	int x_next = ceil((Delta_mu[0] - img_stack.rect->min[1]) / img_stack.rect->dx[1]);
 
@@ -294,7 +315,10 @@ void los_integral_clouds(
 			y += exp(logDelta_EBV[i-1]) / img_stack.rect->dx[0];
 		}
 
-		int x_start = x;
+		// Reddening is constant across [x, x_next), so each row only
+		// contributes the difference of two of its cumulative sums
+		if(x_next <= x) { continue; }
+
 		for(int k=0; k<img_stack.N_images; k++) {
 			y_scaled = y_0 + y*subpixel[k];
 			y_floor = floor(y_scaled);
@@ -305,11 +329,14 @@ void los_integral_clouds(
 			//if(y_ceil_int >= y_max) { std::cout << "!! y_ceil_int >= y_max !!" << std::endl; break; }
 			//if(y_floor_int < 0) { std::cout << "!! y_floor_int < 0 !!" << std::endl; break; }
 
-			for(x = x_start; x<x_next; x++) {
-				ret[k] += (y_ceil - y_scaled) * img_stack.img[k]->at<floating_t>(y_floor_int, x)
-				          + (y_scaled - y_floor) * img_stack.img[k]->at<floating_t>(y_ceil_int, x);
-			}
+			const floating_t *row_floor = img_stack.cumsum + k*img_stack.cumsum_stride + y_floor_int*row_stride;
+			const floating_t *row_ceil = img_stack.cumsum + k*img_stack.cumsum_stride + y_ceil_int*row_stride;
+
+			ret[k] += (y_ceil - y_scaled) * (row_floor[x_next] - row_floor[x])
+			          + (y_scaled - y_floor) * (row_ceil[x_next] - row_ceil[x]);
 		}
+
+		x = x_next;
 	}
 }
 
@@ -438,16 +465,29 @@ void gen_rand_los_extinction_clouds(double *const x, unsigned int N, gsl_rng *r,
 
 void sample_los_extinction(const std::string& out_fname, const std::string& group_name,
                            TMCMCOptions &options, TLOSMCMCParams &params,
-                           int verbosity) {
+                           int verbosity, TWriteQueue *write_queue) {
 	timespec t_start, t_write, t_end;
 	clock_gettime(CLOCK_MONOTONIC, &t_start);
 
+	// Line integrals run along rows of each star's image
+	params.img_stack->set_layout(TImgStack::LAYOUT_IMAGES);
+
 	if(verbosity >= 1) {
 		//std::cout << std::endl;
 		std::cout << "Piecewise-linear l.o.s. model" << std::endl;
 		std::cout << "====================================" << std::endl;
 	}
 
+	// Coarse-to-fine: the guess and the early burn-in are run on binned
+	// copies of the images, and the ensemble is then promoted one level
+	// at a time to full resolution
+	unsigned int coarsest_level = params.build_img_pyramid(2);
+	params.set_img_level(coarsest_level);
+
+	if(verbosity >= 2) {
+		std::cout << "# Image pyramid levels: " << params.get_N_img_levels() << std::endl;
+	}
+
 	if(verbosity >= 2) {
 		std::cout << "guess of EBV max = " << params.EBV_guess_max << std::endl;
 	}
@@ -510,8 +550,26 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t mix_step = &mix_log_Delta_EBVs;
 	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t move_one_step = &step_one_Delta_EBV;
 
+	// Cache the per-region line integrals of each walker's state (the
+	// states evaluated since a walker was last visited are those of the
+	// other walkers of its sampler), so local moves are cheaper
+	params.init_los_int_cache(2*N_samplers*ndim);
+
 	TParallelAffineSampler<TLOSMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
 
+	// Run burn-in round <r> (starting from 1) at level (coarsest - r + 1)
+	auto set_round_img_level = [&](unsigned int round) {
+		unsigned int level = (round <= coarsest_level) ? coarsest_level - round + 1 : 0;
+		if(level == params.get_img_level()) { return; }
+
+		params.set_img_level(level);
+		sampler.recompute_pdf();
+
+		if(verbosity >= 2) {
+			std::cout << "# Promoted to image level " << level << std::endl;
+		}
+	};
+
 	// Burn-in
 	if(verbosity >= 1) { std::cout << "# Burn-in ..." << std::endl; }
 
@@ -554,6 +612,7 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	}
 
 	// Round 2 (5/20)
+	set_round_img_level(2);
 
 	sampler.set_replacement_accept_bias(1.e-2);
 
@@ -588,6 +647,7 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	}
 
 	// Round 3 (5/20)
+	set_round_img_level(3);
 
 	if(verbosity >= 2) {
 		std::cout << "scale: (";
@@ -618,6 +678,7 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	}
 
 	// Round 4 (5/20)
+	set_round_img_level(4);
 	sampler.set_replacement_accept_bias(0.);
 
 	//sampler.tune_MH(8, 0.25);
@@ -649,6 +710,10 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 		std::cout << std::endl;
 	}
 
+	// Burn-in has finished at full resolution
+	assert(params.get_img_level() == 0);
+	params.clear_img_pyramid();
+
 	sampler.clear();
 
 	// Main sampling phase (15/15)
@@ -745,20 +810,26 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 		}
 	}
 
+	if(verbosity >= 2) {
+		std::cout << "# Fraction of region line integrals computed: "
+		          << params.los_int_cache_work_fraction() << std::endl;
+	}
+	params.init_los_int_cache(0);
+
 	clock_gettime(CLOCK_MONOTONIC, &t_write);
 
 	std::stringstream group_name_full;
 	group_name_full << "/" << group_name;
 	TChain chain = sampler.get_chain();
 
-	TChainWriteBuffer writeBuffer(ndim, 500, 1);
-	writeBuffer.add(chain, converged, std::numeric_limits<double>::quiet_NaN(), GR_transf.data());
-	writeBuffer.write(out_fname, group_name_full.str(), "los");
+	std::shared_ptr<TChainWriteBuffer> writeBuffer = std::make_shared<TChainWriteBuffer>(ndim, 500, 1);
+	writeBuffer->add(chain, converged, std::numeric_limits<double>::quiet_NaN(), GR_transf.data());
+	queue_write(write_queue, writeBuffer, out_fname, group_name_full.str(), "los");
 
 	std::stringstream los_group_name;
 	los_group_name << group_name_full.str() << "/los";
-	H5Utils::add_watermark<double>(out_fname, los_group_name.str(), "DM_min", params.img_stack->rect->min[1]);
-	H5Utils::add_watermark<double>(out_fname, los_group_name.str(), "DM_max", params.img_stack->rect->max[1]);
+	queue_watermark<double>(write_queue, out_fname, los_group_name.str(), "DM_min", params.img_stack->rect->min[1]);
+	queue_watermark<double>(write_queue, out_fname, los_group_name.str(), "DM_max", params.img_stack->rect->max[1]);
 
 	clock_gettime(CLOCK_MONOTONIC, &t_end);
 
@@ -821,90 +892,323 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	}
 }
 
-void los_integral(TImgStack &img_stack, const double *const subpixel, double *const ret,
-                                        const float *const Delta_EBV, unsigned int N_regions) {
-	assert(img_stack.rect->N_bins[1] % N_regions == 0);
+// # of stars whose line integrals are evaluated together by los_integral
+const int LOS_INTEGRAL_BLOCK = 16;
 
-	const int subsampling = 1;
-	const int N_pix_per_bin = img_stack.rect->N_bins[1] / N_regions;
-	const float N_samples = subsampling * N_pix_per_bin;
-	const int y_max = img_stack.rect->N_bins[0];
+// Integrals of a block of up to LOS_INTEGRAL_BLOCK consecutive stars,
+// beginning with the image at <img_0>, through regions [i_begin, i_end)
+// (numbered from 1) of a piecewise-linear profile. The integral of star
+// k through region i is stored in out[(i-1)*out_stride + k].
+//
+// All stars follow the same path, scaled in E by their subpixel value,
+// so the loop over stars can be made innermost and vectorized.
+//
+// Integer arithmetic is the poor man's fixed-point math. Values of y
+// never exceed 2^13, so a signed Q13.18 format is equivalent to the
+// unsigned Q14.18 format, and converts to float directly. Because y is
+// advanced in exact integer steps, the path through a region depends
+// only on the Delta E(B-V)s up to and including that region.
+typedef void (*TLosIntegralBlockFn)(
+	const floating_t *const img_0, const int32_t img_stride,
+	const int N_cols, const int n_block,
+	const float *const subpixel, const float *const Delta_EBV,
+	const int N_pix_per_bin, const float y_0, const float Delta_y_0,
+	const float dy_mult_factor, const int i_begin, const int i_end,
+	float *const out, const size_t out_stride);
+
+const int LOS_INTEGRAL_PREC = 18;
+
+// Portable version, for any block size
+void los_integral_block(const floating_t *const img_0, const int32_t img_stride,
+                        const int N_cols, const int n_block,
+                        const float *const subpixel, const float *const Delta_EBV,
+                        const int N_pix_per_bin, const float y_0, const float Delta_y_0,
+                        const float dy_mult_factor, const int i_begin, const int i_end,
+                        float *const out, const size_t out_stride) {
+	const int32_t prec_factor_int = (1 << LOS_INTEGRAL_PREC);
+	const float prec_factor = (float)prec_factor_int;
 
-	int x;
+	int32_t y_int[LOS_INTEGRAL_BLOCK];
+	int32_t dy_int[LOS_INTEGRAL_BLOCK];
+	float acc[LOS_INTEGRAL_BLOCK];
 
-	float Delta_y_0 = Delta_EBV[0] / img_stack.rect->dx[0];
-	const float y_0 = -img_stack.rect->min[0] / img_stack.rect->dx[0];
-	float y, dy;
+	for(int k=0; k<n_block; k++) {
+		float y = y_0 + subpixel[k] * Delta_y_0;
+		y_int[k] = (int32_t)(prec_factor * y);
+	}
 
-	// Integer arithmetic is the poor man's fixed-point math
-	typedef uint32_t fixed_point_t;
-	const int base_2_prec = 18;	// unsigned Q14.18 format
+	// Skip to the beginning of region <i_begin>
+	for(int i=1; i<i_begin; i++) {
+		for(int k=0; k<n_block; k++) {
+			float dy = subpixel[k] * Delta_EBV[i] * dy_mult_factor;
+			y_int[k] += N_pix_per_bin * (int32_t)(prec_factor * dy);
+		}
+	}
 
-	const fixed_point_t prec_factor_int = (1 << base_2_prec);
-	const float prec_factor = (float)prec_factor_int;
+	int x = (i_begin - 1) * N_pix_per_bin;
 
-	fixed_point_t y_int, dy_int;
-	fixed_point_t y_ceil, y_floor;
-	fixed_point_t diff;
+	for(int i=i_begin; i<i_end; i++) {
+		// Determine y increment in region (slope)
+		for(int k=0; k<n_block; k++) {
+			float dy = subpixel[k] * Delta_EBV[i] * dy_mult_factor;
+			dy_int[k] = (int32_t)(prec_factor * dy);
+			acc[k] = 0.;
+		}
 
-	// Pre-computed multiplicative factors
-	float dy_mult_factor = 1. / N_samples / img_stack.rect->dx[0];
-	float ret_mult_factor = 1. / (float)subsampling / prec_factor;
+		// For each DM pixel
+		for(int j=0; j<N_pix_per_bin; j++, x++) {
+			// For each star
+			#pragma omp simd
+			for(int k=0; k<n_block; k++) {
+				int32_t y_floor = (y_int[k] >> LOS_INTEGRAL_PREC);
+				int32_t diff = y_int[k] - (y_floor << LOS_INTEGRAL_PREC);
 
-	float tmp_ret, tmp_subpixel;
-	cv::Mat *img;
+				int32_t idx = k*img_stride + y_floor*N_cols + x;
+				acc[k] += (float)(prec_factor_int - diff) * img_0[idx]
+				        + (float)diff * img_0[idx + N_cols];
+
+				y_int[k] += dy_int[k];
+			}
+		}
 
-	// For each image
-	for(int k=0; k<img_stack.N_images; k++) {
-		tmp_ret = 0.;
-		img = img_stack.img[k];
-		tmp_subpixel = subpixel[k];
+		for(int k=0; k<n_block; k++) {
+			out[(i-1)*out_stride + k] = acc[k];
+		}
+	}
+}
 
-		x = 0;
-		y = y_0 + tmp_subpixel * Delta_y_0;
-		y_int = (fixed_point_t)(prec_factor * y);
+#ifdef LOS_INTEGRAL_X86_DISPATCH
 
-		for(int i=1; i<N_regions+1; i++) {
-			// Determine y increment in region (slope)
-			dy = tmp_subpixel * Delta_EBV[i] * dy_mult_factor;
-			dy_int = (fixed_point_t)(prec_factor * dy);
+// Versions using AVX2 (two vectors of 8 stars) and AVX-512 (one vector
+// of 16 stars) gathers, for full blocks only. They agree with the
+// portable version to within rounding (the compiler may fuse the
+// multiply-adds).
+//
+// The gathers load 4-byte pixels, so these require a 32-bit floating_t
+// (see definitions.h).
+static_assert(sizeof(floating_t) == sizeof(float),
+              "The x86 los_integral kernels require floating_t to be float. "
+              "Disable LOS_INTEGRAL_X86_DISPATCH (top of this file) to "
+              "build with another type.");
+
+__attribute__((target("avx2")))
+void los_integral_block_avx2(const floating_t *const img_0, const int32_t img_stride,
+                             const int N_cols, const int n_block,
+                             const float *const subpixel, const float *const Delta_EBV,
+                             const int N_pix_per_bin, const float y_0, const float Delta_y_0,
+                             const float dy_mult_factor, const int i_begin, const int i_end,
+                             float *const out, const size_t out_stride) {
+	assert(n_block == LOS_INTEGRAL_BLOCK);
+
+	const float prec_factor = (float)(1 << LOS_INTEGRAL_PREC);
+	const __m256i prec_factor_int = _mm256_set1_epi32(1 << LOS_INTEGRAL_PREC);
+	const __m256i frac_mask = _mm256_set1_epi32((1 << LOS_INTEGRAL_PREC) - 1);
+	const __m256i N_cols_v = _mm256_set1_epi32(N_cols);
+	const __m256i N_pix_v = _mm256_set1_epi32(N_pix_per_bin);
+
+	__m256 sub[2];
+	__m256i y_int[2], dy_int[2], idx_0[2];
+	__m256 acc[2];
+
+	for(int h=0; h<2; h++) {
+		sub[h] = _mm256_loadu_ps(subpixel + 8*h);
+		__m256 y = _mm256_add_ps(_mm256_set1_ps(y_0),
+		                         _mm256_mul_ps(sub[h], _mm256_set1_ps(Delta_y_0)));
+		y_int[h] = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_set1_ps(prec_factor), y));
+		idx_0[h] = _mm256_mullo_epi32(
+			_mm256_setr_epi32(8*h, 8*h+1, 8*h+2, 8*h+3, 8*h+4, 8*h+5, 8*h+6, 8*h+7),
+			_mm256_set1_epi32(img_stride));
+	}
 
-			// For each DM pixel
-			for(int j=0; j<N_pix_per_bin; j++, x++, y_int+=dy_int) {
+	for(int i=1; i<i_end; i++) {
+		for(int h=0; h<2; h++) {
+			__m256 dy = _mm256_mul_ps(_mm256_mul_ps(sub[h], _mm256_set1_ps(Delta_EBV[i])),
+			                          _mm256_set1_ps(dy_mult_factor));
+			dy_int[h] = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_set1_ps(prec_factor), dy));
+		}
 
-				// Manual loop unrolling. It's ugly, but it works!
+		// Skip to the beginning of region <i_begin>
+		if(i < i_begin) {
+			for(int h=0; h<2; h++) {
+				y_int[h] = _mm256_add_epi32(y_int[h], _mm256_mullo_epi32(N_pix_v, dy_int[h]));
+			}
+			continue;
+		}
 
-				// 0
-				y_floor = (y_int >> base_2_prec);
-				diff = y_int - (y_floor << base_2_prec);
+		acc[0] = _mm256_setzero_ps();
+		acc[1] = _mm256_setzero_ps();
 
-				tmp_ret += (prec_factor_int - diff) * img->at<floating_t>(y_floor, x)
-				        + diff * img->at<floating_t>(y_floor+1, x);
+		int x = (i - 1) * N_pix_per_bin;
+		for(int j=0; j<N_pix_per_bin; j++, x++) {
+			for(int h=0; h<2; h++) {
+				__m256i y_floor = _mm256_srli_epi32(y_int[h], LOS_INTEGRAL_PREC);
+				__m256i diff = _mm256_and_si256(y_int[h], frac_mask);
 
-				/*
-				// 1
-				y_int += dy_int;
-				y_floor = (y_int >> base_2_prec);
-				diff = y_int - (y_floor << base_2_prec);
+				__m256i idx = _mm256_add_epi32(idx_0[h], _mm256_mullo_epi32(y_floor, N_cols_v));
+				__m256 p_0 = _mm256_i32gather_ps(img_0 + x, idx, 4);
+				__m256 p_1 = _mm256_i32gather_ps(img_0 + x + N_cols, idx, 4);
 
-				tmp_ret += diff * img->at<floating_t>(y_floor, x)
-				        + (prec_factor_int - diff) * img->at<floating_t>(y_floor+1, x);
+				__m256 w_1 = _mm256_cvtepi32_ps(diff);
+				__m256 w_0 = _mm256_cvtepi32_ps(_mm256_sub_epi32(prec_factor_int, diff));
 
-				// 2
-				y_int += dy_int;
-				y_floor = (y_int >> base_2_prec);
-				diff = y_int - (y_floor << base_2_prec);
+				acc[h] = _mm256_add_ps(acc[h], _mm256_add_ps(_mm256_mul_ps(w_0, p_0),
+				                                             _mm256_mul_ps(w_1, p_1)));
 
-				tmp_ret += diff * img->at<floating_t>(y_floor, x)
-				        + (prec_factor_int - diff) * img->at<floating_t>(y_floor+1, x);
-				*/
+				y_int[h] = _mm256_add_epi32(y_int[h], dy_int[h]);
 			}
 		}
 
-		ret[k] = tmp_ret * ret_mult_factor;
+		_mm256_storeu_ps(out + (i-1)*out_stride, acc[0]);
+		_mm256_storeu_ps(out + (i-1)*out_stride + 8, acc[1]);
 	}
 }
 
+__attribute__((target("avx512f")))
+void los_integral_block_avx512(const floating_t *const img_0, const int32_t img_stride,
+                               const int N_cols, const int n_block,
+                               const float *const subpixel, const float *const Delta_EBV,
+                               const int N_pix_per_bin, const float y_0, const float Delta_y_0,
+                               const float dy_mult_factor, const int i_begin, const int i_end,
+                               float *const out, const size_t out_stride) {
+	assert(n_block == LOS_INTEGRAL_BLOCK);
+
+	const float prec_factor = (float)(1 << LOS_INTEGRAL_PREC);
+	const __m512i prec_factor_int = _mm512_set1_epi32(1 << LOS_INTEGRAL_PREC);
+	const __m512i frac_mask = _mm512_set1_epi32((1 << LOS_INTEGRAL_PREC) - 1);
+	const __m512i N_cols_v = _mm512_set1_epi32(N_cols);
+	const __m512i N_pix_v = _mm512_set1_epi32(N_pix_per_bin);
+
+	const __m512 sub = _mm512_loadu_ps(subpixel);
+	__m512 y = _mm512_add_ps(_mm512_set1_ps(y_0),
+	                         _mm512_mul_ps(sub, _mm512_set1_ps(Delta_y_0)));
+	__m512i y_int = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_set1_ps(prec_factor), y));
+	const __m512i idx_0 = _mm512_mullo_epi32(
+		_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+		_mm512_set1_epi32(img_stride));
+
+	for(int i=1; i<i_end; i++) {
+		__m512 dy = _mm512_mul_ps(_mm512_mul_ps(sub, _mm512_set1_ps(Delta_EBV[i])),
+		                          _mm512_set1_ps(dy_mult_factor));
+		__m512i dy_int = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_set1_ps(prec_factor), dy));
+
+		// Skip to the beginning of region <i_begin>
+		if(i < i_begin) {
+			y_int = _mm512_add_epi32(y_int, _mm512_mullo_epi32(N_pix_v, dy_int));
+			continue;
+		}
+
+		__m512 acc = _mm512_setzero_ps();
+
+		int x = (i - 1) * N_pix_per_bin;
+		for(int j=0; j<N_pix_per_bin; j++, x++) {
+			__m512i y_floor = _mm512_srli_epi32(y_int, LOS_INTEGRAL_PREC);
+			__m512i diff = _mm512_and_si512(y_int, frac_mask);
+
+			__m512i idx = _mm512_add_epi32(idx_0, _mm512_mullo_epi32(y_floor, N_cols_v));
+			__m512 p_0 = _mm512_i32gather_ps(idx, img_0 + x, 4);
+			__m512 p_1 = _mm512_i32gather_ps(idx, img_0 + x + N_cols, 4);
+
+			__m512 w_1 = _mm512_cvtepi32_ps(diff);
+			__m512 w_0 = _mm512_cvtepi32_ps(_mm512_sub_epi32(prec_factor_int, diff));
+
+			acc = _mm512_add_ps(acc, _mm512_add_ps(_mm512_mul_ps(w_0, p_0),
+			                                       _mm512_mul_ps(w_1, p_1)));
+
+			y_int = _mm512_add_epi32(y_int, dy_int);
+		}
+
+		_mm512_storeu_ps(out + (i-1)*out_stride, acc);
+	}
+}
+
+#endif // LOS_INTEGRAL_X86_DISPATCH
+
+// Choose the fastest version of los_integral_block for full blocks that
+// this CPU supports
+TLosIntegralBlockFn select_los_integral_block() {
+#ifdef LOS_INTEGRAL_X86_DISPATCH
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) { return &los_integral_block_avx512; }
+	if(__builtin_cpu_supports("avx2")) { return &los_integral_block_avx2; }
+#endif // LOS_INTEGRAL_X86_DISPATCH
+	return &los_integral_block;
+}
+
+void los_integral_partial(TImgStack &img_stack, const double *const subpixel, float *const partial,
+                          const float *const Delta_EBV, unsigned int N_regions,
+                          unsigned int i_begin, unsigned int i_end) {
+	assert(img_stack.rect->N_bins[1] % N_regions == 0);
+	assert(img_stack.layout == TImgStack::LAYOUT_IMAGES);
+	assert((i_begin >= 1) && (i_end <= N_regions+1));
+
+	if(i_begin >= i_end) { return; }
+
+	const int subsampling = 1;
+	const int N_cols = img_stack.rect->N_bins[1];
+	const int N_pix_per_bin = N_cols / N_regions;
+	const float N_samples = subsampling * N_pix_per_bin;
+
+	float Delta_y_0 = Delta_EBV[0] / img_stack.rect->dx[0];
+	const float y_0 = -img_stack.rect->min[0] / img_stack.rect->dx[0];
+
+	// Pre-computed multiplicative factors
+	float dy_mult_factor = 1. / N_samples / img_stack.rect->dx[0];
+
+	static const TLosIntegralBlockFn los_integral_block_full = select_los_integral_block();
+
+	// Offsets into a block of images are 32-bit
+	assert(LOS_INTEGRAL_BLOCK * img_stack.img_stride < (size_t)INT32_MAX);
+
+	float subpixel_block[LOS_INTEGRAL_BLOCK];
+
+	// For each block of images
+	const int N_images = img_stack.N_images;
+	for(int k0=0; k0<N_images; k0+=LOS_INTEGRAL_BLOCK) {
+		int n_block = std::min(LOS_INTEGRAL_BLOCK, N_images - k0);
+
+		for(int k=0; k<n_block; k++) {
+			subpixel_block[k] = subpixel[k0+k];
+		}
+
+		TLosIntegralBlockFn block_fn = (n_block == LOS_INTEGRAL_BLOCK)
+		                               ? los_integral_block_full
+		                               : &los_integral_block;
+		block_fn(
+			img_stack.data + k0*img_stack.img_stride, img_stack.img_stride,
+			N_cols, n_block, subpixel_block, Delta_EBV,
+			N_pix_per_bin, y_0, Delta_y_0, dy_mult_factor,
+			i_begin, i_end, partial + k0, N_images
+		);
+	}
+}
+
+void los_integral_sum(const float *const partial, size_t N_images,
+                      unsigned int N_regions, double *const ret) {
+	const int subsampling = 1;
+	const double ret_mult_factor = 1. / (double)subsampling / (double)(1 << LOS_INTEGRAL_PREC);
+
+	for(size_t k=0; k<N_images; k++) { ret[k] = 0.; }
+
+	for(unsigned int i=0; i<N_regions; i++) {
+		const float *const p = partial + i*N_images;
+		#pragma omp simd
+		for(size_t k=0; k<N_images; k++) { ret[k] += p[k]; }
+	}
+
+	for(size_t k=0; k<N_images; k++) { ret[k] *= ret_mult_factor; }
+}
+
+void los_integral(TImgStack &img_stack, const double *const subpixel, double *const ret,
+                                        const float *const Delta_EBV, unsigned int N_regions) {
+	// Scratch space for the integrals through each region
+	static thread_local std::vector<float> partial;
+	partial.resize(N_regions * img_stack.N_images);
+
+	los_integral_partial(img_stack, subpixel, partial.data(), Delta_EBV,
+	                     N_regions, 1, N_regions+1);
+	los_integral_sum(partial.data(), img_stack.N_images, N_regions, ret);
+}
+
 double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCParams& params) {
 	double lnp = 0.;
 
@@ -956,7 +1260,11 @@ double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCPa
 
 	// Compute line integrals through probability surfaces
 	double *line_int = params.get_line_int(thread_num);
-	los_integral(*(params.img_stack), params.subpixel.data(), line_int, Delta_EBV, N-1);
+	if(params.los_int_cache_enabled()) {
+		params.los_integral_cached(logEBV, Delta_EBV, line_int);
+	} else {
+		los_integral(*(params.img_stack), params.subpixel.data(), line_int, Delta_EBV, N-1);
+	}
 
 	// Soften and multiply line integrals
 	double lnp_indiv;
@@ -1419,6 +1727,7 @@ double switch_log_Delta_EBVs(double *const _X, double *const _Y, unsigned int _N
 // Custom reversible step for piecewise-linear model.
 // Switch two log(Delta E(B-V)) values.
 double switch_adjacent_log_Delta_EBVs(double *const _X, double *const _Y, unsigned int _N, gsl_rng* r, TLOSMCMCParams& _params) {
+	_params.set_local_move_origin(_X);
 	for(int i=0; i<_N; i++) { _Y[i] = _X[i]; }
 
 	// Choose which Deltas to switch
@@ -1433,6 +1742,7 @@ double switch_adjacent_log_Delta_EBVs(double *const _X, double *const _Y, unsign
 
 
 double mix_log_Delta_EBVs(double *const _X, double *const _Y, unsigned int _N, gsl_rng* r, TLOSMCMCParams& _params) {
+	_params.set_local_move_origin(_X);
 	for(int i=0; i<_N; i++) { _Y[i] = _X[i]; }
 
 	// Choose two Deltas to mix
@@ -1457,6 +1767,7 @@ double mix_log_Delta_EBVs(double *const _X, double *const _Y, unsigned int _N, g
 
 
 double step_one_Delta_EBV(double *const _X, double *const _Y, unsigned int _N, gsl_rng* r, TLOSMCMCParams& _params) {
+	_params.set_local_move_origin(_X);
 	for(int i=0; i<_N; i++) { _Y[i] = _X[i]; }
 
 	// Choose Delta to step in
@@ -1485,7 +1796,8 @@ TLOSMCMCParams::TLOSMCMCParams(
 	  N_runs(_N_runs), N_threads(_N_threads), N_regions(_N_regions),
 	  line_int(NULL), Delta_EBV_prior(NULL),
 	  log_Delta_EBV_prior(NULL), sigma_log_Delta_EBV(NULL),
-	  guess_cov(NULL), guess_sqrt_cov(NULL)
+	  guess_cov(NULL), guess_sqrt_cov(NULL),
+	  img_stack_full(_img_stack), img_level(0)
 {
 	line_int = new double[_img_stack->N_images * N_threads];
 	Delta_EBV = new float[(N_regions+1) * N_threads];
@@ -1509,6 +1821,8 @@ TLOSMCMCParams::TLOSMCMCParams(
 	subpixel_max = 1.;
 	subpixel_min = 1.;
 	alpha_skew = 0.;
+
+	init_los_int_cache(0);
 }
 
 TLOSMCMCParams::~TLOSMCMCParams() {
@@ -1550,6 +1864,9 @@ void TLOSMCMCParams::set_subpixel_mask(std::vector<double>& new_mask) {
 		if(new_mask[i] < subpixel_min) { subpixel_min = new_mask[i]; }
 		subpixel.push_back(new_mask[i]);
 	}
+
+	// Cached line integrals depend on the mask
+	init_los_int_cache(los_int_cache_enabled() ? los_int_cache[0].N_entries : 0);
 }
 
 // Calculate the mean and std. dev. of log(delta_EBV)
@@ -1735,6 +2052,185 @@ float* TLOSMCMCParams::get_Delta_EBV(unsigned int thread_num) {
 	return Delta_EBV + (N_regions+1) * thread_num;
 }
 
+// Limit on the memory used by the line-integral caches of all threads
+const size_t LOS_INT_CACHE_MAX_BYTES = (size_t)1 << 30;
+
+void TLOSMCMCParams::init_los_int_cache(unsigned int N_entries) {
+	const size_t N_images = img_stack->N_images;
+	const size_t entry_bytes = N_regions * N_images * sizeof(float);
+
+	if((entry_bytes > 0) && (entry_bytes * N_entries * N_threads > LOS_INT_CACHE_MAX_BYTES)) {
+		N_entries = LOS_INT_CACHE_MAX_BYTES / (entry_bytes * N_threads);
+	}
+
+	los_int_cache.clear();
+	los_int_cache.resize(N_threads);
+
+	for(std::vector<TLOSIntCache>::iterator c = los_int_cache.begin(); c != los_int_cache.end(); ++c) {
+		c->N_entries = N_entries;
+		c->state.resize(N_entries * (N_regions+1));
+		c->partial.resize(N_entries * N_regions * N_images);
+		c->filled.assign(N_entries, false);
+		c->next = 0;
+		c->origin.resize(N_regions+1);
+		c->has_origin = false;
+		c->N_evals = 0;
+		c->N_regions_evaluated = 0;
+	}
+}
+
+unsigned int TLOSMCMCParams::build_img_pyramid(unsigned int max_level) {
+	clear_img_pyramid();
+
+	const TImgStack *fine = img_stack_full;
+	for(unsigned int level=1; level<=max_level; level++) {
+		const unsigned int factor = 1 << level;
+		if((img_stack_full->rect->N_bins[0] % factor != 0) ||
+		   (img_stack_full->rect->N_bins[1] % (factor * N_regions) != 0)) {
+			break;
+		}
+
+		// Each level is binned from the one above it
+		std::shared_ptr<TImgStack> coarse = std::make_shared<TImgStack>(0);
+		fine->downsample(2, *coarse);
+		img_pyramid.push_back(coarse);
+		fine = coarse.get();
+	}
+
+	return img_pyramid.size();
+}
+
+void TLOSMCMCParams::clear_img_pyramid() {
+	set_img_level(0);
+	img_pyramid.clear();
+}
+
+void TLOSMCMCParams::set_img_level(unsigned int level) {
+	assert(level <= img_pyramid.size());
+	if(level == img_level) { return; }
+
+	img_level = level;
+	img_stack = (level == 0) ? img_stack_full : img_pyramid[level-1].get();
+
+	// Cached line integrals depend on the images
+	init_los_int_cache(los_int_cache_enabled() ? los_int_cache[0].N_entries : 0);
+}
+
+unsigned int TLOSMCMCParams::get_img_level() const {
+	return img_level;
+}
+
+unsigned int TLOSMCMCParams::get_N_img_levels() const {
+	return img_pyramid.size() + 1;
+}
+
+bool TLOSMCMCParams::los_int_cache_enabled() const {
+	return (!los_int_cache.empty()) && (los_int_cache[0].N_entries != 0);
+}
+
+void TLOSMCMCParams::set_local_move_origin(const double *const logEBV) {
+	if(!los_int_cache_enabled()) { return; }
+
+	int thread_num = omp_get_thread_num();
+	assert(thread_num < N_threads);
+
+	TLOSIntCache &c = los_int_cache[thread_num];
+	std::copy(logEBV, logEBV + N_regions + 1, c.origin.begin());
+	c.has_origin = true;
+}
+
+void TLOSMCMCParams::los_integral_cached(const double *const logEBV,
+                                         const float *const Delta_EBV,
+                                         double *const ret) {
+	int thread_num = omp_get_thread_num();
+	assert(thread_num < N_threads);
+
+	TLOSIntCache &c = los_int_cache[thread_num];
+
+	const unsigned int N = N_regions + 1;
+	const size_t N_images = img_stack->N_images;
+	const size_t entry_size = N_regions * N_images;
+
+	// Look up the state that this proposal was made from, if any
+	int origin_idx = -1;
+	if(c.has_origin) {
+		for(unsigned int e=0; e<c.N_entries; e++) {
+			if(c.filled[e] && std::equal(c.origin.begin(), c.origin.end(), c.state.begin() + e*N)) {
+				origin_idx = e;
+				break;
+			}
+		}
+		c.has_origin = false;
+	}
+
+	// Store this state in the oldest entry, keeping the origin if possible
+	unsigned int slot = c.next;
+	if(((int)slot == origin_idx) && (c.N_entries > 1)) {
+		slot = (slot + 1) % c.N_entries;
+	}
+	c.next = (slot + 1) % c.N_entries;
+	float *const partial = c.partial.data() + slot * entry_size;
+
+	// Determine which regions have to be recomputed. A change to
+	// Delta E(B-V)[i] moves the path through region i (and, since y
+	// is shifted, every region after it). Swapping two adjacent
+	// slopes leaves y unchanged beyond them. This holds for any pair of
+	// states, so the result does not depend on the origin being the
+	// true one - only the amount of work saved does.
+	unsigned int i_begin = 1;
+	unsigned int i_end = N_regions + 1;
+
+	if(origin_idx >= 0) {
+		const double *const X = c.state.data() + origin_idx * N;
+
+		unsigned int lo = 0;
+		while((lo < N) && (X[lo] == logEBV[lo])) { lo++; }
+
+		if(lo == N) {
+			i_begin = i_end;
+		} else {
+			unsigned int hi = N - 1;
+			while(X[hi] == logEBV[hi]) { hi--; }
+
+			if((lo >= 1) && (hi == lo + 1) && (X[lo] == logEBV[hi]) && (X[hi] == logEBV[lo])) {
+				i_begin = lo;
+				i_end = hi + 1;
+			} else {
+				i_begin = std::max(lo, 1U);
+			}
+		}
+
+		if((int)slot != origin_idx) {
+			std::memcpy(partial, c.partial.data() + origin_idx * entry_size,
+			            entry_size * sizeof(float));
+		}
+	}
+
+	los_integral_partial(*img_stack, subpixel.data(), partial, Delta_EBV,
+	                     N_regions, i_begin, i_end);
+
+	std::copy(logEBV, logEBV + N, c.state.begin() + slot * N);
+	c.filled[slot] = true;
+
+	c.N_evals++;
+	if(i_end > i_begin) { c.N_regions_evaluated += i_end - i_begin; }
+
+	los_integral_sum(partial, N_images, N_regions, ret);
+}
+
+double TLOSMCMCParams::los_int_cache_work_fraction() const {
+	uint64_t N_evals = 0;
+	uint64_t N_regions_evaluated = 0;
+
+	for(std::vector<TLOSIntCache>::const_iterator c = los_int_cache.begin(); c != los_int_cache.end(); ++c) {
+		N_evals += c->N_evals;
+		N_regions_evaluated += c->N_regions_evaluated;
+	}
+
+	if(N_evals == 0) { return 1.; }
+	return (double)N_regions_evaluated / (double)(N_evals * N_regions);
+}
+
 
 
 /****************************************************************************************************************************
@@ -1745,15 +2241,12 @@ float* TLOSMCMCParams::get_Delta_EBV(unsigned int thread_num) {
 
 TDiscreteLosMcmcParams::TDiscreteLosMcmcParams(
 	TImgStack *_img_stack, unsigned int _N_runs, unsigned int _N_threads)
-		: img_stack(_img_stack), N_runs(_N_runs), N_threads(_N_threads)
+		: img_stack(_img_stack), N_runs(_N_runs), N_threads(_N_threads),
+		  n_temperatures(1), beta_min(0.01)
 {
     n_dists = img_stack->rect->N_bins[1];
     n_E = img_stack->rect->N_bins[0];
 
-    line_int = new double[img_stack->N_images * N_threads];
-
-	E_pix_idx = new int16_t[n_dists * N_threads];
-
 	y_zero_idx = -img_stack->rect->min[0] / img_stack->rect->dx[0];
 
 	// Priors
@@ -1773,10 +2266,7 @@ TDiscreteLosMcmcParams::TDiscreteLosMcmcParams(
 }
 
 
-TDiscreteLosMcmcParams::~TDiscreteLosMcmcParams() {
-    if(line_int != NULL) { delete[] line_int; }
-    if(E_pix_idx != NULL) { delete[] E_pix_idx; }
-}
+TDiscreteLosMcmcParams::~TDiscreteLosMcmcParams() {}
 
 
 void TDiscreteLosMcmcParams::initialize_priors(
@@ -1865,18 +2355,6 @@ void TDiscreteLosMcmcParams::initialize_priors(
 }
 
 
-double* TDiscreteLosMcmcParams::get_line_int(unsigned int thread_num) {
-	assert(thread_num < N_threads);
-	return line_int + img_stack->N_images * thread_num;
-}
-
-
-int16_t* TDiscreteLosMcmcParams::get_E_pix_idx(unsigned int thread_num) {
-	assert(thread_num < N_threads);
-	return E_pix_idx + n_dists * thread_num;
-}
-
-
 // Calculates the line integrals for a model in which each distance bin has a
 // (possibly) different, constant reddening.
 //
@@ -1891,21 +2369,84 @@ void TDiscreteLosMcmcParams::los_integral_discrete(
 		const int16_t *const y_idx,
         double *const line_int_ret)
 {
-    // For each image
-	for(int k = 0; k < img_stack->N_images; k++) {
+	assert(img_stack->cumsum_stars != NULL);
+	assert(img_stack->layout == TImgStack::LAYOUT_STAR_INNER);
+
+	const int n_stars = img_stack->N_images;
+
+	for(int k = 0; k < n_stars; k++) {
 		line_int_ret[k] = 0.;
+	}
 
-		// For each distance
-		for(int j = 0; j < n_dists; j++) {
-		    line_int_ret[k] += (double)img_stack->img[k]->at<floating_t>(y_idx[j], j);
-		}
+	// For each run of constant reddening, add the sum of the pixels
+	// along it for every star
+	int j1;
+	for(int j0 = 0; j0 < n_dists; j0 = j1) {
+		j1 = profile_run_end(y_idx, j0, n_dists);
+
+		const double *const c0 = img_stack->cumsum_stars_at(y_idx[j0], j0);
+		const double *const c1 = img_stack->cumsum_stars_at(y_idx[j0], j1);
 
-		// line_int_ret[k] *= img_stack->rect->dx[1];	// Multiply by dDM
+		#pragma omp simd
+		for(int k = 0; k < n_stars; k++) {
+		    line_int_ret[k] += c1[k] - c0[k];
+		}
 	}
 	// line_int_ret[0] = 1.; // TODO: remove this line.
 }
 
 
+// End (exclusive) of the run of constant y_idx that starts at <x_begin>,
+// stopping at <x_end>.
+int TDiscreteLosMcmcParams::profile_run_end(
+		const int16_t *const y_idx,
+		const int x_begin,
+		const int x_end)
+{
+	int j = x_begin + 1;
+	while((j < x_end) && (y_idx[j] == y_idx[x_begin])) { j++; }
+	return j;
+}
+
+
+// Calculates the change to the line integrals when the profile is
+// shifted by <dy> over the distance bins [x_begin, x_end). Each run of
+// constant y_idx costs four lookups in the cumulative sums, whatever
+// its length.
+void TDiscreteLosMcmcParams::los_integral_diff_shift_runs(
+		const int x_begin,
+		const int x_end,
+		const int16_t dy,
+		const int16_t *const y_idx_old,
+		double *const delta_line_int_ret)
+{
+	assert(img_stack->cumsum_stars != NULL);
+	assert(img_stack->layout == TImgStack::LAYOUT_STAR_INNER);
+
+	const int n_stars = img_stack->N_images;
+
+	for(int k=0; k < n_stars; k++) {
+		delta_line_int_ret[k] = 0;
+	}
+
+	int j1;
+	for(int j0 = x_begin; j0 < x_end; j0 = j1) {
+		j1 = profile_run_end(y_idx_old, j0, x_end);
+
+		const int y_old = y_idx_old[j0];
+		const double *const c0_new = img_stack->cumsum_stars_at(y_old+dy, j0);
+		const double *const c1_new = img_stack->cumsum_stars_at(y_old+dy, j1);
+		const double *const c0_old = img_stack->cumsum_stars_at(y_old, j0);
+		const double *const c1_old = img_stack->cumsum_stars_at(y_old, j1);
+
+		#pragma omp simd
+		for(int k=0; k < n_stars; k++) {
+			delta_line_int_ret[k] += (c1_new[k] - c0_new[k]) - (c1_old[k] - c0_old[k]);
+		}
+	}
+}
+
+
 // Calculates the change to the line integrals for a step that changes the
 // value of E in one distance bin.
 //
@@ -1921,11 +2462,14 @@ void TDiscreteLosMcmcParams::los_integral_diff_step(
         const int16_t y_idx_new,
 		double *const delta_line_int_ret)
 {
+	const int n_stars = img_stack->N_images;
+	const floating_t *const p_new = img_stack->stars_at(y_idx_new, x_idx);
+	const floating_t *const p_old = img_stack->stars_at(y_idx_old, x_idx);
+
     // For each image
-	for(int k=0; k < img_stack->N_images; k++) {
-	    delta_line_int_ret[k] = (double)img_stack->img[k]->at<floating_t>(y_idx_new, x_idx)
-	                          - (double)img_stack->img[k]->at<floating_t>(y_idx_old, x_idx);
-  		// delta_line_int_ret[k] *= img_stack->rect->dx[1];	// Multiply by dDM
+	#pragma omp simd
+	for(int k=0; k < n_stars; k++) {
+	    delta_line_int_ret[k] = (double)p_new[k] - (double)p_old[k];
 	}
 }
 
@@ -2031,11 +2575,14 @@ void TDiscreteLosMcmcParams::los_integral_diff_swap(
 	int16_t y_old = y_idx[x0_idx];
 	int16_t y_new = y_idx[x0_idx-1] + dy;
 
+	const int n_stars = img_stack->N_images;
+	const floating_t *const p_new = img_stack->stars_at(y_new, x0_idx);
+	const floating_t *const p_old = img_stack->stars_at(y_old, x0_idx);
+
     // For each image
-	for(int k = 0; k < img_stack->N_images; k++) {
-	    delta_line_int_ret[k] = (double)img_stack->img[k]->at<floating_t>(y_new, x0_idx)
-	                          - (double)img_stack->img[k]->at<floating_t>(y_old, x0_idx);
-		// delta_line_int_ret[k] *= img_stack->rect->dx[1];	// Multiply by dDM
+	#pragma omp simd
+	for(int k = 0; k < n_stars; k++) {
+	    delta_line_int_ret[k] = (double)p_new[k] - (double)p_old[k];
 	}
 }
 
@@ -2087,18 +2634,7 @@ void TDiscreteLosMcmcParams::los_integral_diff_shift_r(
 	// }
 
 	// Determine difference in line integral
-
-	// For each image
-	for(int k=0; k < img_stack->N_images; k++) {
-		delta_line_int_ret[k] = 0;
-
-		// For each distance
-		for(int j=x_idx; j<n_dists; j++) {
-			delta_line_int_ret[k] +=
-				  (double)img_stack->img[k]->at<floating_t>(y_idx_old[j]+dy, j)
-				- (double)img_stack->img[k]->at<floating_t>(y_idx_old[j], j);
-		}
-	}
+	los_integral_diff_shift_runs(x_idx, n_dists, dy, y_idx_old, delta_line_int_ret);
 }
 
 void TDiscreteLosMcmcParams::los_integral_diff_shift_l(
@@ -2107,17 +2643,7 @@ void TDiscreteLosMcmcParams::los_integral_diff_shift_l(
 		const int16_t *const y_idx_old,
 		double *const delta_line_int_ret) {
 	// Determine difference in line integral
-	// For each image
-	for(int k=0; k < img_stack->N_images; k++) {
-		delta_line_int_ret[k] = 0;
-
-		// For each distance
-		for(int j=0; j<=x_idx; j++) {
-			delta_line_int_ret[k] +=
-				  (double)img_stack->img[k]->at<floating_t>(y_idx_old[j]+dy, j)
-				- (double)img_stack->img[k]->at<floating_t>(y_idx_old[j], j);
-		}
-	}
+	los_integral_diff_shift_runs(0, x_idx+1, dy, y_idx_old, delta_line_int_ret);
 }
 
 void TDiscreteLosMcmcParams::los_integral_diff_shift_compare_operations(
@@ -2173,8 +2699,9 @@ floating_t TDiscreteLosMcmcParams::log_prior_diff_shift_r(
 }
 
 
-void TDiscreteLosMcmcParams::guess_EBV_profile_discrete(int16_t *const y_idx_ret, gsl_rng *r) {
-    double EBV_max_guess = guess_EBV_max(*img_stack) * (0.8 + 0.4 * gsl_rng_uniform(r));
+void TDiscreteLosMcmcParams::guess_EBV_profile_discrete(
+		int16_t *const y_idx_ret, double EBV_max, gsl_rng *r) {
+    double EBV_max_guess = EBV_max * (0.8 + 0.4 * gsl_rng_uniform(r));
 
     int n_x = n_dists; //img_stack->rect->N_bins[1];
     int n_y = n_E; //img_stack->rect->N_bins[0];
@@ -2450,435 +2977,555 @@ bool discrete_proposal_valid(
 }
 
 
-void sample_los_extinction_discrete(
-		const std::string& out_fname, const std::string& group_name,
-        TMCMCOptions& options, TDiscreteLosMcmcParams& params,
-        int verbosity) {
-    // Random number generator
-    gsl_rng *r;
-	seed_gsl_rng(&r);
+// Change in the log-likelihood of a discrete l.o.s. proposal,
+//   sum_k log(1 + delta_line_int[k] / (line_int[k] + epsilon)).
+// This runs once per proposal, over every star. libm's log does not
+// vectorize, so the logarithm is computed inline, following fdlibm's
+// log, with the exponent extracted bitwise (accurate to ~1 ulp). The
+// rounding error of 1 + u is corrected for, so that small changes to
+// the line integrals are not lost.
+typedef double (*TDiscreteDlogLFn)(
+	const double *const delta_line_int, const double *const line_int,
+	const double epsilon, const int n_stars);
+
+static inline __attribute__((always_inline)) double discrete_dlogL_body(
+		const double *const delta_line_int,
+		const double *const line_int,
+		const double epsilon,
+		const int n_stars)
+{
+	// log(1 + f) = f - f^2/2 + s (f^2/2 + R(s^2)), with s = f / (2 + f)
+	const double Lg1 = 6.666666666666735130e-01;
+	const double Lg2 = 3.999999999940941908e-01;
+	const double Lg3 = 2.857142874366239149e-01;
+	const double Lg4 = 2.222219843214978396e-01;
+	const double Lg5 = 1.818357216161805012e-01;
+	const double Lg6 = 1.531383769920937332e-01;
+	const double Lg7 = 1.479819860511658591e-01;
+	const double ln2_hi = 6.93147180369123816490e-01;
+	const double ln2_lo = 1.90821492927058770002e-10;
+	const double inf = std::numeric_limits<double>::infinity();
+
+	double dlogL = 0.;
+	double n_nonpositive = 0.;	// # of stars with 1 + u <= 0 (or NaN)
+	double n_infinite = 0.;		// # of stars with 1 + u = infinity
+
+	#pragma omp simd reduction(+:dlogL, n_nonpositive, n_infinite)
+	for(int k = 0; k < n_stars; k++) {
+		const double u = delta_line_int[k] / (line_int[k] + epsilon);
+		const double x = 1. + u;
+		const double c = (u - (x - 1.)) / x;	// Rounding error in 1 + u
+
+		// x = m 2^e, with sqrt(2)/2 <= m < sqrt(2)
+		union { double d; uint64_t i; } bits, e_bits, m_bits;
+		bits.d = x;
+		bits.i += 0x3ff0000000000000ULL - 0x3fe6a09e667f3bcdULL;
+		e_bits.i = (bits.i >> 52) | 0x4330000000000000ULL;
+		m_bits.i = (bits.i & 0x000fffffffffffffULL) + 0x3fe6a09e667f3bcdULL;
+		const double e = e_bits.d - (4503599627370496. + 1023.);
+		const double m = m_bits.d;
+
+		const double f = m - 1.;
+		const double hfsq = 0.5 * f * f;
+		const double s = f / (2. + f);
+		const double z = s * s;
+		const double w = z * z;
+		const double R = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7)))
+		               + w * (Lg2 + w * (Lg4 + w * Lg6));
+
+		dlogL += e * ln2_hi + ((f - (hfsq - s * (hfsq + R))) + (e * ln2_lo + c));
+
+		n_nonpositive += (x > 0.) ? 0. : 1.;
+		n_infinite += (x == inf) ? 1. : 0.;
+	}
 
-	int n_x = params.img_stack->rect->N_bins[1];    // # of distance pixels
-	int n_y = params.img_stack->rect->N_bins[0];    // # of reddening pixels
-	int n_stars = params.img_stack->N_images;       // # of stars
-
-    // Temporary variables
-	double dlog_p;
-	double log_p = 0;
-	double logL = 0;
-	double logPr = 0;
-	double ln_proposal_factor = 0;
-	double* line_int = new double[n_stars];
-	double* delta_line_int = new double[n_stars];
-
-	double* line_int_test = new double[n_stars];
-	double* line_int_test_old = new double[n_stars];
-
-	// Calculate line integrals with correct line-of-sight distribution
-	// int16_t* y_idx_true = new int16_t[n_x];
-	// double* line_int_true = new double[n_stars];
-	//
-	// for(int j=0; j<24; j++) {
-	// 	y_idx_true[j] = 0;
-	// }
-	// for(int j=24; j<72; j++) {
-	// 	y_idx_true[j] = 100;
-	// }
-	// for(int j=72; j<n_x; j++) {
-	// 	y_idx_true[j] = 150;
-	// }
-    //
-	// params.los_integral_discrete(y_idx_true, line_int_true);
-	//
-	// std::cerr << "true l.o.s. integral (0) = "
-	//           << line_int_true[0] << std::endl;
+	// Outside of the domain, the sum above is meaningless
+	if(n_nonpositive != 0.) { return -inf; }
+	if(n_infinite != 0.) { return inf; }
 
-    // Guess reddening profile
-    int16_t* y_idx = new int16_t[n_x];
-    double* y_idx_dbl = new double[n_x];
-    params.guess_EBV_profile_discrete(y_idx, r);
+	return dlogL;
+}
 
-    // Calculate initial line integral for each star
-    params.los_integral_discrete(y_idx, line_int);
+// Portable version (vectorized for the baseline instruction set)
+double discrete_dlogL(const double *const delta_line_int,
+                      const double *const line_int,
+                      const double epsilon, const int n_stars) {
+	return discrete_dlogL_body(delta_line_int, line_int, epsilon, n_stars);
+}
 
-	// params.los_integral_discrete(y_idx, line_int_test_old);
+#ifdef LOS_INTEGRAL_X86_DISPATCH
 
-	// Calculate initial prior
-	logPr = params.log_prior(y_idx);
+__attribute__((target("avx2")))
+double discrete_dlogL_avx2(const double *const delta_line_int,
+                           const double *const line_int,
+                           const double epsilon, const int n_stars) {
+	return discrete_dlogL_body(delta_line_int, line_int, epsilon, n_stars);
+}
 
-    // for(int k = 0; k < n_x; k++) {
-    //     y_idx_dbl[k] = (double)(y_idx[k]);
-    // }
+#endif // LOS_INTEGRAL_X86_DISPATCH
 
-	// Number of steps, samples to save, etc.
-    int n_steps = 0.5 * (options.steps * n_x);
-	int n_burnin = 0.25 * n_steps;
-	int n_save = 1000;
-	int save_every = n_steps / n_save;
-    int save_in = save_every;
-
-	// How often to recalculate exact line integrals
-	int recalculate_every = 100;
-	int recalculate_in = recalculate_every;
-
-	// Acceptance statistics
-	int64_t n_proposals[] = {0, 0, 0, 0, 0, 0},
-	        n_proposals_accepted[] = {0, 0, 0, 0, 0, 0},
-			n_proposals_valid[] = {0, 0, 0, 0, 0, 0};
-
-    // Chain
-    TChain chain(n_x, 1.1*n_save+5);
-
-	// std::cerr << std::endl
-	// 	      << "##################################" << std::endl
-	// 		  << "n_x = " << n_x << std::endl
-	// 		  << "n_y = " << n_y << std::endl
-	// 		  << "n_stars = " << n_stars << std::endl
-	// 		  << "n_steps = " << n_steps << std::endl
-	// 		  << "##################################" << std::endl
-	// 		  << std::endl;
-
-    int w = 0;
-
-    // Softening parameter
-    // TODO: Make p_badstar either a config option or dep. on ln(Z)
-    const floating_t p_badstar = 1.e-9; //0.0001;
-    const floating_t epsilon = p_badstar / (floating_t)n_y;
-
-    double sigma_dy_neg = 1.e-5;
-    double sigma_dy_neg_target = 1.e-10;
-    double tau_decay = (double)n_steps / 5.;
-
-	// Proposal settings
-	// TODO: Set these more intelligently, or make them configurable?
-	// Mean value of y chosen in "absolute shift" proposals
-	double y_shift_abs_mean = n_y / 20;
-	// Maximum value of y chosen in "absolute shift" proposals
-	double y_shift_abs_max = n_y;
+TDiscreteDlogLFn select_discrete_dlogL() {
+#ifdef LOS_INTEGRAL_X86_DISPATCH
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) { return &discrete_dlogL_avx2; }
+#endif // LOS_INTEGRAL_X86_DISPATCH
+	return &discrete_dlogL;
+}
+
+
+// One chain of the discrete l.o.s. sampler, targeting
+//     p(y) ∝ L(y)^beta prior(y),
+// where beta is the inverse temperature. The chain with beta = 1
+// samples the posterior, while hotter chains (beta < 1) see a flatter
+// likelihood, and are used for parallel tempering. Each chain keeps
+// its own profile and line integrals, so chains can run on separate
+// threads, and can exchange states with one another.
+struct TDiscreteLosChain {
+	TDiscreteLosMcmcParams& params;
+	gsl_rng *r;
+	double beta;	// Inverse temperature
+
+	std::vector<int16_t> y_idx;		// Profile (y-index at each distance)
+	std::vector<double> line_int;	// Line integral for each star
+	double logL, logPr;				// ln(likelihood) and ln(prior) of profile
 
-	// uint64_t n_eval_diff = 0;
-	// uint64_t n_eval_cumulative = 0;
-	// uint64_t n_shift_steps = 0;
+	// Acceptance statistics, one entry per proposal type
+	int64_t n_proposals[N_PROPOSAL_TYPES];
+	int64_t n_proposals_accepted[N_PROPOSAL_TYPES];
+	int64_t n_proposals_valid[N_PROPOSAL_TYPES];
+
+	// Starts from a random guess of the profile, reaching roughly
+	// <EBV_max> (see guess_EBV_max)
+	TDiscreteLosChain(TDiscreteLosMcmcParams& _params, gsl_rng *_r,
+	                  double _beta, double EBV_max);
+
+	// Make one Metropolis-Hastings step
+	void step();
+
+	// Calculate the line integrals and ln(likelihood) exactly
+	void recalculate();
+
+	// Exchange states (profile, line integrals, likelihood and prior)
+	// with another chain. The temperatures stay with the chains.
+	void swap_state(TDiscreteLosChain& other);
+
+	// Show the profile, and check the running line integrals and prior
+	void print_state(std::ostream& out);
+
+private:
+	int n_x, n_y, n_stars;
+
+	// Softening parameter
+	floating_t epsilon;
+
+	// Mean and maximum value of y chosen in "absolute shift" proposals
+	double y_shift_abs_mean, y_shift_abs_max;
+
+	std::vector<double> delta_line_int;
+
+	// How often (in accepted steps) to recalculate exact line integrals
+	int recalculate_every, recalculate_in;
 
 	DiscreteProposal proposal_type;
+};
+
+
+TDiscreteLosChain::TDiscreteLosChain(
+		TDiscreteLosMcmcParams& _params, gsl_rng *_r, double _beta,
+		double EBV_max)
+	: params(_params), r(_r), beta(_beta)
+{
+	n_x = params.img_stack->rect->N_bins[1];    // # of distance pixels
+	n_y = params.img_stack->rect->N_bins[0];    // # of reddening pixels
+	n_stars = params.img_stack->N_images;       // # of stars
+
+	// TODO: Make p_badstar either a config option or dep. on ln(Z)
+	const floating_t p_badstar = 1.e-9; //0.0001;
+	epsilon = p_badstar / (floating_t)n_y;
+
+	// TODO: Set these more intelligently, or make them configurable?
+	y_shift_abs_mean = n_y / 20;
+	y_shift_abs_max = n_y;
+
+	y_idx.resize(n_x);
+	line_int.resize(n_stars);
+	delta_line_int.resize(n_stars);
+
+	for(int i=0; i<N_PROPOSAL_TYPES; i++) {
+		n_proposals[i] = 0;
+		n_proposals_accepted[i] = 0;
+		n_proposals_valid[i] = 0;
+	}
+
+	recalculate_every = 100;
+	recalculate_in = recalculate_every;
+
+	// Guess reddening profile
+	params.guess_EBV_profile_discrete(y_idx.data(), EBV_max, r);
+
+	// Calculate initial line integral for each star, and initial prior
+	recalculate();
+	logPr = params.log_prior(y_idx.data());
+}
+
+
+void TDiscreteLosChain::recalculate() {
+	params.los_integral_discrete(y_idx.data(), line_int.data());
+
+	logL = 0.;
+	for(int k = 0; k < n_stars; k++) {
+		logL += log(line_int[k] + epsilon);
+	}
+}
+
 
-    for(int i = 0; i < n_steps + n_burnin; i++) {
-        sigma_dy_neg -= (sigma_dy_neg - sigma_dy_neg_target) / tau_decay;
-        params.inv_sigma_dy_neg = 1. / sigma_dy_neg;
-
-		// Increase weight of current state
-        w += 1;
-
-		// Propose a new state
-		int x_idx, dy, y_idx_new, dy1;
-
-		// Determine what type of proposal to make
-		proposal_type.roll(r);
-		// int proposal_type = gsl_rng_uniform_int(r, N_PROPOSAL_TYPES);
-		// int proposal_type = STEP_PROPOSAL;
-		// int proposal_type;
-		// double prop_rand = gsl_rng_uniform(r);
-		// const double p_swap = 0.8;
-		// const double p_step = 0.1;
-		// // const double p_shift = 0.1;
-		// if(prop_rand < p_swap) {
-		// 	proposal_type = SWAP_PROPOSAL;
-		// } else if(prop_rand < p_swap + p_step) {
-		// 	proposal_type = STEP_PROPOSAL;
-		// } else {
-		// 	proposal_type = SHIFT_PROPOSAL;
-		// }
-
-		n_proposals[proposal_type.code]++;
-
-		if(proposal_type.step) {
-			discrete_propose_step(r, n_x, x_idx, dy);
-			y_idx_new = y_idx[x_idx] + dy;
-		} else if(proposal_type.swap) {
-			discrete_propose_swap(r, n_x, x_idx);
-			dy1 = y_idx[x_idx+1] - y_idx[x_idx];
-	        y_idx_new = y_idx[x_idx-1] + dy1;
-		} else if(proposal_type.absolute) {
-			// SHIFT_ABS_L_PROPOSAL or SHIFT_ABS_R_PROPOSAL
-			discrete_propose_shift_abs(
-				r, y_idx, n_x, y_shift_abs_mean, y_shift_abs_max,
-				x_idx, dy, ln_proposal_factor
+void TDiscreteLosChain::swap_state(TDiscreteLosChain& other) {
+	std::swap(y_idx, other.y_idx);
+	std::swap(line_int, other.line_int);
+	std::swap(logL, other.logL);
+	std::swap(logPr, other.logPr);
+}
+
+
+void TDiscreteLosChain::step() {
+	static const TDiscreteDlogLFn discrete_dlogL_fn = select_discrete_dlogL();
+
+	// Propose a new state
+	int x_idx, dy, y_idx_new, dy1;
+	double ln_proposal_factor = 0;
+
+	// Determine what type of proposal to make
+	proposal_type.roll(r);
+
+	n_proposals[proposal_type.code]++;
+
+	if(proposal_type.step) {
+		discrete_propose_step(r, n_x, x_idx, dy);
+		y_idx_new = y_idx[x_idx] + dy;
+	} else if(proposal_type.swap) {
+		discrete_propose_swap(r, n_x, x_idx);
+		dy1 = y_idx[x_idx+1] - y_idx[x_idx];
+		y_idx_new = y_idx[x_idx-1] + dy1;
+	} else if(proposal_type.absolute) {
+		// SHIFT_ABS_L_PROPOSAL or SHIFT_ABS_R_PROPOSAL
+		discrete_propose_shift_abs(
+			r, y_idx.data(), n_x, y_shift_abs_mean, y_shift_abs_max,
+			x_idx, dy, ln_proposal_factor
+		);
+	} else {
+		// SHIFT_L_PROPOSAL or SHIFT_R_PROPOSAL
+		discrete_propose_shift(r, n_x, x_idx, dy);
+	}
+
+	// Check if the proposal lands in a valid region of parameter space
+	bool prop_valid = discrete_proposal_valid(
+		proposal_type, y_idx_new, n_y,
+		params, x_idx, dy, y_idx.data());
+
+	if(!prop_valid) { return; }
+
+	n_proposals_valid[proposal_type.code]++;
+
+	double dlogL = 0;
+	double dlogPr, alpha;
+
+	// Calculate difference in line integrals and prior (between the
+	// current and proposed states).
+	if(proposal_type.step) {
+		params.los_integral_diff_step(
+			x_idx,
+			y_idx[x_idx],
+			y_idx_new,
+			delta_line_int.data()
+		);
+		dlogPr = params.log_prior_diff_step(x_idx, y_idx.data(), y_idx_new);
+	} else if(proposal_type.swap) {
+		params.los_integral_diff_swap(
+			x_idx, y_idx.data(),
+			delta_line_int.data()
+		);
+		dlogPr = params.log_prior_diff_swap(x_idx, y_idx.data());
+	} else if(proposal_type.left) {
+		dlogPr = params.log_prior_diff_shift_l(x_idx, dy, y_idx.data());
+		// No point in calculating line integrals if prior -> -infinity.
+		if(dlogPr != -std::numeric_limits<double>::infinity()) {
+			params.los_integral_diff_shift_l(
+				x_idx, dy, y_idx.data(),
+				delta_line_int.data()
 			);
-		} else {
-			// SHIFT_L_PROPOSAL or SHIFT_R_PROPOSAL
-			discrete_propose_shift(r, n_x, x_idx, dy);
-		}
-
-        // int y_idx_new = y_idx[x_idx] + dy;
-
-		// Check if the proposal lands in a valid region of parameter space
-		bool prop_valid = discrete_proposal_valid(
-			proposal_type, y_idx_new, n_y,
-			params, x_idx, dy, y_idx);
-
-        if(prop_valid) {
-			n_proposals_valid[proposal_type.code]++;
-
-			double dlogL = 0;
-	        double dlogPr, alpha;
-
-            // Calculate difference in line integrals and prior (between the
-			// current and proposed states).
-			if(proposal_type.step) {
-	            params.los_integral_diff_step(
-					x_idx,
-					y_idx[x_idx],
-					y_idx_new,
-					delta_line_int
-				);
-				dlogPr = params.log_prior_diff_step(x_idx, y_idx, y_idx_new);
-			} else if(proposal_type.swap) {
-				params.los_integral_diff_swap(
-					x_idx, y_idx,
-					delta_line_int
-				);
-				dlogPr = params.log_prior_diff_swap(x_idx, y_idx);
-			} else if(proposal_type.left) {
-				dlogPr = params.log_prior_diff_shift_l(x_idx, dy, y_idx);
-				// No point in calculating line integrals if prior -> -infinity.
-				if(dlogPr != -std::numeric_limits<double>::infinity()) {
-					params.los_integral_diff_shift_l(
-						x_idx, dy, y_idx,
-						delta_line_int
-					);
-				}
+		}
+	} else { // SHIFT_R_PROPOSAL or SHIFT_ABS_R_PROPOSAL
+		dlogPr = params.log_prior_diff_shift_r(x_idx, dy, y_idx.data());
+		// No point in calculating line integrals if prior -> -infinity.
+		if(dlogPr != -std::numeric_limits<double>::infinity()) {
+			params.los_integral_diff_shift_r(
+				x_idx, dy, y_idx.data(),
+				delta_line_int.data()
+			);
+		}
+	}
 
-				// std::cerr << dlogPr << std::endl;
-			} else { // SHIFT_R_PROPOSAL or SHIFT_ABS_R_PROPOSAL
-				dlogPr = params.log_prior_diff_shift_r(x_idx, dy, y_idx);
-
-				// if(x_idx == 0) {
-				// 	std::cerr << "shift(0, "
-				// 			  << y_idx[0] << " -> " << y_idx[0] + dy
-				// 			  << ") : dln(prior) = " << dlogPr
-				// 			  << std::endl;
-				// }
-
-				// No point in calculating line integrals if prior -> -infinity.
-				if(dlogPr != -std::numeric_limits<double>::infinity()) {
-					params.los_integral_diff_shift_r(
-						x_idx, dy, y_idx,
-						delta_line_int
-					);
-
-					// unsigned int n_eval_diff_tmp;
-					// unsigned int n_eval_cumulative_tmp;
-					// params.los_integral_diff_shift_compare_operations(
-					// 	x_idx, dy, y_idx,
-					// 	n_eval_diff_tmp,
-					// 	n_eval_cumulative_tmp
-					// );
-					//
-					// n_eval_diff += n_eval_diff_tmp;
-					// n_eval_cumulative += n_eval_cumulative_tmp;
-					// n_shift_steps++;
+	// Change in likelihood
+	if(dlogPr != -std::numeric_limits<double>::infinity()) {
+		dlogL = discrete_dlogL_fn(delta_line_int.data(), line_int.data(), epsilon, n_stars);
+	}
 
+	// Acceptance probability, with the likelihood tempered
+	alpha = beta * dlogL + dlogPr;
 
-				}
-			}
+	if(proposal_type.absolute) {
+		alpha += ln_proposal_factor;
+	}
 
-            // Change in likelihood
-			if(dlogPr != -std::numeric_limits<double>::infinity()) {
-	            for(int k = 0; k < n_stars; k++) {
-	                dlogL += log(1.0 + delta_line_int[k] / (line_int[k]+epsilon));
-	            }
+	// Accept proposal?
+	if((alpha > 1) || (exp(alpha) > gsl_rng_uniform(r))) {
+		n_proposals_accepted[proposal_type.code]++;
+
+		// Update state to proposal
+		if(!proposal_type.shift) {
+			// STEP_PROPOSAL or SWAP_PROPOSAL
+			y_idx[x_idx] = y_idx_new;
+		} else if(proposal_type.left) {
+			for(int j=0; j<=x_idx; j++) {
+				y_idx[j] += dy;
+			}
+		} else { // SHIFT_R_PROPOSAL or SHIFT_ABS_R_PROPOSAL
+			for(int j=x_idx; j<params.n_dists; j++) {
+				y_idx[j] += dy;
 			}
+		}
 
-            // Acceptance probability
-            alpha = dlogL + dlogPr;
+		// Update prior & likelihood
+		logL += dlogL;
+		logPr += dlogPr;
 
-			if(proposal_type.absolute) {
-				alpha += ln_proposal_factor;
+		// Update line integrals, calculating them exactly every certain
+		// number of steps
+		if(--recalculate_in == 0) {
+			recalculate_in = recalculate_every;
+			recalculate();
+		} else {
+			for(int k = 0; k < n_stars; k++) {
+				line_int[k] += delta_line_int[k];
 			}
+		}
+	}
+}
 
-			// Accept proposal?
-            if((alpha > 1) || (exp(alpha) > gsl_rng_uniform(r))) {
-				// if((dlogPr < -10000) || (dlogPr > 10000)) {
-				// 	std::cerr << "dlogPr = " << dlogPr << std::endl
-				// 	          << "  proposal_type = " << proposal_type << std::endl
-				// 			  << "  x_idx = " << x_idx << std::endl
-				// 			  << "  dy = " << dy << std::endl
-				// 			  << "  y_idx[0] = " << y_idx[0] << std::endl;
-				// 	std::exit(1);
-				// }
-
-                // ACCEPT
-				n_proposals_accepted[proposal_type.code]++;
-
-                // Add old point to chain
-                // chain.add_point(y_idx_dbl, log_p, (double)w);
-
-                // Update state to proposal
-				if(!proposal_type.shift) {
-					// STEP_PROPOSAL or SWAP_PROPOSAL
-	                y_idx[x_idx] = y_idx_new;
-	                // y_idx_dbl[x_idx] = (double)y_idx_new;
-				} else if(proposal_type.left) {
-					for(int j=0; j<=x_idx; j++) {
-						y_idx[j] += dy;
-					}
-				} else { // SHIFT_R_PROPOSAL or SHIFT_ABS_R_PROPOSAL
-					for(int j=x_idx; j<params.n_dists; j++) {
-						y_idx[j] += dy;
-						// y_idx_dbl[j] = (double)(y_idx[j]);
+
+void TDiscreteLosChain::print_state(std::ostream& out) {
+	discrete_los_ascii_art(
+		n_x, n_y, y_idx.data(),
+		40, 700,
+		params.img_stack->rect->dx[0],
+		4., 19.,
+		out);
+	out << std::endl;
+
+	std::vector<double> line_int_test(n_stars);
+	params.los_integral_discrete(y_idx.data(), line_int_test.data());
+	double abs_resid_max = -std::numeric_limits<double>::infinity();
+	double rel_resid_max = -std::numeric_limits<double>::infinity();
+	for(int k=0; k<n_stars; k++) {
+		double abs_resid = line_int[k] - line_int_test[k];
+		double rel_resid = abs_resid / line_int_test[k];
+		abs_resid_max = std::max(abs_resid_max, abs_resid);
+		rel_resid_max = std::max(rel_resid_max, rel_resid);
+	}
+	out << std::endl
+	    << "max. line integral residuals: "
+	    << abs_resid_max << " (abs) "
+	    << rel_resid_max << " (rel)"
+	    << std::endl;
+
+	double log_Pr_tmp = params.log_prior(y_idx.data());
+	out << "log(prior) : "
+	    << log_Pr_tmp << " (actual) "
+	    << logPr << " (running) "
+	    << log_Pr_tmp - logPr << " (difference)"
+	    << std::endl << std::endl;
+}
+
+
+void sample_los_extinction_discrete(
+		const std::string& out_fname, const std::string& group_name,
+        TMCMCOptions& options, TDiscreteLosMcmcParams& params,
+        int verbosity, TWriteQueue *write_queue) {
+	// Each proposal touches a few pixels (or runs of pixels, through
+	// the cumulative sums), for every star
+	params.img_stack->set_layout(TImgStack::LAYOUT_STAR_INNER);
+	params.img_stack->build_cumsum();
+
+	int n_x = params.img_stack->rect->N_bins[1];    // # of distance pixels
+
+	// Independent replicas, each with its own random number generator,
+	// run in parallel
+	const int n_replicas = std::max(params.N_runs, 1U);
+	const int n_save = 1000;	// # of samples saved by each replica
+
+	// Parallel tempering: each replica runs a ladder of chains, with
+	// inverse temperatures spaced geometrically from 1 down to
+	// params.beta_min. Only the coldest chain (beta = 1) is saved.
+	const int n_temp = std::max(params.n_temperatures, 1U);
+	std::vector<double> beta(n_temp, 1.);
+	for(int t=1; t<n_temp; t++) {
+		beta[t] = pow(params.beta_min, (double)t / (double)(n_temp-1));
+	}
+
+	// Chain n*n_temp + t is replica n, temperature t. Chains run in
+	// parallel (up to one per thread of <params>).
+	const int n_chains = n_replicas * n_temp;
+	const int n_chain_threads = std::max(std::min(params.N_threads, (unsigned int)n_chains), 1U);
+
+	// Seeds for the chains are drawn from one generator, so that they
+	// are distinct even if the chains start at the same time
+	gsl_rng *r_seed;
+	seed_gsl_rng(&r_seed);
+	std::vector<unsigned long int> seed(n_chains);
+	for(int c=0; c<n_chains; c++) {
+		seed[c] = gsl_rng_get(r_seed);
+	}
+	gsl_rng_free(r_seed);
+
+	// Scale of the starting profiles, shared by all chains
+	const double EBV_max = guess_EBV_max(*(params.img_stack));
+
+	std::vector<gsl_rng*> r(n_chains);
+	std::vector<std::unique_ptr<TDiscreteLosChain> > pt_chain(n_chains);
+
+	#pragma omp parallel for schedule(dynamic) num_threads(n_chain_threads)
+	for(int c=0; c<n_chains; c++) {
+		r[c] = gsl_rng_alloc(gsl_rng_taus);
+		gsl_rng_set(r[c], seed[c]);
+		pt_chain[c].reset(new TDiscreteLosChain(params, r[c], beta[c % n_temp], EBV_max));
+	}
+
+	std::vector<std::shared_ptr<TChain> > chain(n_replicas);
+	for(int n=0; n<n_replicas; n++) {
+		chain[n] = std::make_shared<TChain>(n_x, 1.1*n_save+5);
+	}
+
+	// Number of steps, samples to save, etc.
+	const int n_steps = 0.5 * (options.steps * n_x);
+	const int n_burnin = 0.25 * n_steps;
+	const int save_every = n_steps / n_save;
+	std::vector<int> save_in(n_replicas, save_every);
+	std::vector<double> y_idx_dbl(n_replicas*n_x);
+
+	// Neighbouring temperatures attempt to swap states every
+	// <swap_every> steps. Without tempering, the chains run straight
+	// through.
+	const int swap_every = (n_temp > 1) ? n_x : std::max(n_steps + n_burnin, 1);
+
+	// Swap statistics, for each pair of neighbouring temperatures
+	std::vector<int64_t> n_swaps(n_temp, 0), n_swaps_accepted(n_temp, 0);
+
+	for(int i0=0; i0<n_steps+n_burnin; i0+=swap_every) {
+		const int i1 = std::min(i0+swap_every, n_steps+n_burnin);
+
+		#pragma omp parallel for schedule(dynamic) num_threads(n_chain_threads)
+		for(int c=0; c<n_chains; c++) {
+			TDiscreteLosChain& ch = *(pt_chain[c]);
+			const int n = c / n_temp;
+			const bool cold = (c % n_temp == 0);
+
+			for(int i=i0; i<i1; i++) {
+				ch.step();
+
+				if(!cold) { continue; }
+
+				// Add state to chain. The saved ln(p) is absolute, since
+				// states move between temperatures.
+				if((i >= n_burnin) && (--save_in[n] == 0)) {
+					double *const y = &(y_idx_dbl[n*n_x]);
+					for(int k=0; k<n_x; k++) {
+						y[k] = (double)ch.y_idx[k];
 					}
+					chain[n]->add_point(y, ch.logL + ch.logPr, 1.);
+					save_in[n] = save_every;
 				}
 
-				// Update line integrals
-                for(int k = 0; k < n_stars; k++) {
-                    line_int[k] += delta_line_int[k];
-                }
+				if((c == 0) && (verbosity >= 2) && (i % 10000 == 0)) {
+					ch.print_state(std::cerr);
+					ascii_progressbar(i, n_steps+n_burnin, 50, std::cerr);
+					std::cerr << std::endl;
+				}
+			}
+		}
 
-				// Calculate line integrals exactly every certain number of steps
-				if(--recalculate_in == 0) {
-					recalculate_in = recalculate_every;
-					params.los_integral_discrete(y_idx, line_int);
+		// Propose swaps between neighbouring temperatures, from the
+		// hottest pair down, so that states can travel to beta = 1 in
+		// one round
+		for(int n=0; n<n_replicas; n++) {
+			for(int t=n_temp-2; t>=0; t--) {
+				TDiscreteLosChain& ch_cold = *(pt_chain[n*n_temp + t]);
+				TDiscreteLosChain& ch_hot = *(pt_chain[n*n_temp + t + 1]);
+				double alpha = (ch_cold.beta - ch_hot.beta) * (ch_hot.logL - ch_cold.logL);
+
+				n_swaps[t]++;
+				if((alpha > 0) || (exp(alpha) > gsl_rng_uniform(r[n*n_temp]))) {
+					ch_cold.swap_state(ch_hot);
+					n_swaps_accepted[t]++;
 				}
+			}
+		}
+	}
 
-				// Update prior & likelihood
-				log_p += alpha;
-				logL += dlogL;
-				logPr += dlogPr;
-
-				// double log_Pr_tmp = params.log_prior(y_idx);
-				// std::cerr << std::endl
-				// 		  << "log(prior) : "
-				// 		  << log_Pr_tmp << " (actual) "
-				// 		  << logPr << " (estimate) "
-				// 		  << log_Pr_tmp - logPr << " (difference)"
-				// 		  << std::endl;
-				//
-				// if(fabs(log_Pr_tmp - logPr) > 0.001) {
-				// 	std::cerr << "x_idx = " << x_idx << std::endl;
-				// 	std::exit(1);
-				// }
-
-				// params.los_integral_discrete(y_idx, line_int_test);
-
-				// for(int k=0; k<n_stars; k++) {
-				// 	floating_t delta_true = line_int_test[k] - line_int_test_old[k];
-				// 	floating_t delta_resid = delta_line_int[k] - delta_true;
-				// 	// floating_t rel_delta_resid = delta_resid / delta_true;
-				//
-				// 	if(fabs(delta_resid) > 1.e-10) {
-				// 		floating_t P_old = params.img_stack->img[k]->at<floating_t>(
-				// 			y_idx_new-dy, x_idx);
-				// 		floating_t P_new = params.img_stack->img[k]->at<floating_t>(
-				// 			y_idx_new, x_idx);
-				//
-				// 		std::cerr << "delta_resid[" << k << "] = "
-				// 				  << delta_resid
-				// 				  << " , delta = "
-				// 				  << delta_true
-				// 				  << " , integral = "
-				// 				  << line_int_test[k]
-				// 				  << " , x_idx = "
-				// 				  << x_idx
-				// 				  << std::endl;
-				// 		std::cerr << "  P_old = " << P_old << std::endl
-				// 				  << "  P_new = " << P_new << std::endl
-				// 				  << "  P_new - P_old = " << P_new - P_old << std::endl;
-				// 	}
-				// 	// std::cerr << delta_true << "  " << rel_delta_resid << std::endl;
-				// }
-
-				// std::swap(line_int_test, line_int_test_old);
-
-				// Reset weight to zero
-                w = 0;
-            }
-        }
+	// Acceptance statistics of the coldest chains, summed over replicas
+	int64_t n_proposals[N_PROPOSAL_TYPES],
+	        n_proposals_accepted[N_PROPOSAL_TYPES],
+	        n_proposals_valid[N_PROPOSAL_TYPES];
+	for(int i=0; i<N_PROPOSAL_TYPES; i++) {
+		n_proposals[i] = 0;
+		n_proposals_accepted[i] = 0;
+		n_proposals_valid[i] = 0;
+		for(int n=0; n<n_replicas; n++) {
+			n_proposals[i] += pt_chain[n*n_temp]->n_proposals[i];
+			n_proposals_accepted[i] += pt_chain[n*n_temp]->n_proposals_accepted[i];
+			n_proposals_valid[i] += pt_chain[n*n_temp]->n_proposals_valid[i];
+		}
+	}
 
-		// Add state to chain
-		if((i >= n_burnin) && (--save_in == 0)) {
-			for(int k=0; k<n_x; k++) {
-				y_idx_dbl[k] = (double)y_idx[k];
-			}
-			chain.add_point(y_idx_dbl, log_p, 1.);
-            save_in = save_every;
+	pt_chain.clear();
+	for(int c=0; c<n_chains; c++) {
+		gsl_rng_free(r[c]);
+	}
+
+	// Leave the stack as the other l.o.s. samplers expect it
+	params.img_stack->clear_cumsum();
+	params.img_stack->set_layout(TImgStack::LAYOUT_IMAGES);
+
+	// Gelman-Rubin diagnostic across replicas. Distances at which every
+	// replica stays at one reddening have no variance (R is NaN), and
+	// count as converged.
+	const double GR_threshold = 1.25;
+	std::vector<double> GR;
+	bool converged = true;
+
+	if(n_replicas > 1) {
+		std::vector<TChain*> chain_ptr;
+		for(int n=0; n<n_replicas; n++) {
+			chain_ptr.push_back(chain[n].get());
 		}
+		Gelman_Rubin_diagnostic(chain_ptr, GR, NULL);
 
-		if((verbosity >= 2) && (i % 10000 == 0)) {
-			discrete_los_ascii_art(
-				n_x, n_y, y_idx,
-				40, 700,
-				params.img_stack->rect->dx[0],
-				4., 19.,
-				std::cerr);
-			std::cerr << std::endl;
+		for(int k=0; k<n_x; k++) {
+			if(GR[k] > GR_threshold) { converged = false; }
+		}
 
-			params.los_integral_discrete(y_idx, line_int_test);
-			double abs_resid_max = -std::numeric_limits<double>::infinity();
-			double rel_resid_max = -std::numeric_limits<double>::infinity();
-			for(int k=0; k<n_stars; k++) {
-				double abs_resid = line_int[k] - line_int_test[k];
-				double rel_resid = abs_resid / line_int_test[k];
-				abs_resid_max = std::max(abs_resid_max, abs_resid);
-				rel_resid_max = std::max(rel_resid_max, rel_resid);
+		if(verbosity >= 2) {
+			std::cerr << "G-R Diagnostic:";
+			for(int k=0; k<n_x; k++) {
+				std::cerr << "  " << std::setprecision(3) << GR[k];
 			}
-			std::cerr << std::endl
-					  << "max. line integral residuals: "
-					  << abs_resid_max << " (abs) "
-					  << rel_resid_max << " (rel)"
-					  << std::endl;
-
-			double log_Pr_tmp = params.log_prior(y_idx);
-			std::cerr << "log(prior) : "
-					  << log_Pr_tmp << " (actual) "
-					  << logPr << " (running) "
-					  << log_Pr_tmp - logPr << " (difference)"
-					  << std::endl << std::endl;
-
-			// std::vector<std::pair<int,double>> delta_line_int_true;
-			// double delta_lnL_true = 0.;
-			// for(int k=0; k<n_stars; k++) {
-			// 	double tmp_diff = log(line_int[k]+epsilon) - log(line_int_true[k]+epsilon);
-			// 	delta_line_int_true.emplace_back(k, tmp_diff);
-			// 	delta_lnL_true += tmp_diff;
-			// }
-			// std::sort(
-			// 	delta_line_int_true.begin(),
-			// 	delta_line_int_true.end(),
-			// 	[](std::pair<int,double> _l, std::pair<int,double> _r) -> bool {
-			// 		return _l.second < _r.second;
-			// 	}
-			// );
-			//
-			// std::cerr << "Delta ln(L) = " << delta_lnL_true << std::endl;
-			// int n_show = 4;
-			// for(int k=0; k<n_show; k++) {
-			// 	std::cerr << "  "
-			// 			  << delta_line_int_true.at(k).second
-			// 			  << "  (" << delta_line_int_true.at(k).first << ")"
-			// 			  << std::endl;
-			// }
-			// std::cerr << "  ..." << std::endl;
-			// for(int k=0; k<n_show; k++) {
-			// 	std::cerr << "  "
-			// 			  << delta_line_int_true.at(n_stars-n_show+k).second
-			// 			  << "  (" << delta_line_int_true.at(n_stars-n_show+k).first << ")"
-			// 			  << std::endl;
-			// }
-			// std::cerr << std::endl;
-			//
-			// std::cerr << "l.o.s. integrals (true):" << std::endl;
-			// for(int k=0; k<3; k++) {
-			// 	std::cerr << "  "
-			// 			  << line_int[k]
-			// 			  << "  (" << line_int_true[k] << ")"
-			// 			  << std::endl;
-			// }
-			// std::cerr << std::endl;
-
-			ascii_progressbar(i, n_steps+n_burnin, 50, std::cerr);
 			std::cerr << std::endl;
 		}
-    }
+
+		if((verbosity >= 1) && !converged) {
+			#pragma omp critical (cout)
+			std::cout << "# Discrete l.o.s. replicas failed to converge." << std::endl;
+		}
+	}
 
 	if(verbosity >= 1) {
 		std::string prop_name[N_PROPOSAL_TYPES];
@@ -2903,43 +3550,36 @@ void sample_los_extinction_discrete(
 					  << " *    valid : " << 100. * p_valid << " %" << std::endl
   					  << " * accepted : " << 100. * p_accept << " %" << std::endl;
 		}
-	}
 
-	// std::cerr << std::endl
-	// 		  << "SHIFT STEP EVALUTATIONS:" << std::endl
-	// 		  << "  * differential: "
-	// 		      << (double)n_eval_diff / (double)n_shift_steps
-	// 			  << " eval/step" << std::endl
-	// 		  << "  * cumulative  : "
-	// 			  << (double)n_eval_cumulative / (double)n_shift_steps
-	// 			  << " eval/step" << std::endl
-	// 		  << std::endl;
+		for(int t=0; t<n_temp-1; t++) {
+			double p_swap = (double)n_swaps_accepted[t] / (double)n_swaps[t];
+			std::cerr << "temperature swaps (beta = " << beta[t]
+					  << " <-> " << beta[t+1] << "): "
+					  << 100. * p_swap << " % accepted" << std::endl;
+		}
+	}
 
-    // Add final state to chain
-    // chain.add_point(y_idx_dbl, log_p, (double)w);
+	// Merge the first <n_save> samples of each replica, in order, into
+	// one chain
+	TChain chain_merged(n_x, n_replicas*(1.1*n_save+5));
+	for(int n=0; n<n_replicas; n++) {
+		unsigned int n_points = std::min(chain[n]->get_length(), (unsigned int)n_save);
+		for(unsigned int i=0; i<n_points; i++) {
+			chain_merged.add_point(chain[n]->get_element(i), chain[n]->get_L(i), chain[n]->get_w(i));
+		}
+	}
 
     // Save the chain
-	// chain.save(out_fname, group_name, "")
-    TChainWriteBuffer chain_write_buffer(n_x, n_save, 1);
+    std::shared_ptr<TChainWriteBuffer> chain_write_buffer = std::make_shared<TChainWriteBuffer>(n_x, n_replicas*n_save, 1);
 
-    chain_write_buffer.add(
-		chain,
-		true,	// converged
+    chain_write_buffer->add(
+		chain_merged,
+		converged,
 		std::numeric_limits<double>::quiet_NaN(), // ln(Z)
-		NULL,	// Gelman-Rubin statistic
+		(n_replicas > 1) ? GR.data() : NULL,	// Gelman-Rubin statistic
 		false	// subsample
 	);
-    chain_write_buffer.write(out_fname, group_name, "discrete-los");
-
-    delete[] y_idx;
-    delete[] y_idx_dbl;
-    delete[] line_int;
-    delete[] delta_line_int;
-	delete[] line_int_test;
-	delete[] line_int_test_old;
-	// delete[] y_idx_true;
-	// delete[] line_int_true;
-    gsl_rng_free(r);
+    queue_write(write_queue, chain_write_buffer, out_fname, group_name, "discrete-los");
 }
 
 
@@ -2949,75 +3589,142 @@ void sample_los_extinction_discrete(
  *
  ****************************************************************************************************************************/
 
-TImgStack::TImgStack(size_t _N_images) {
-	N_images = _N_images;
+// Alignment (in bytes) of each image in the stack
+static const size_t IMG_STACK_ALIGN = 64;
+
+TImgStack::TImgStack(size_t _N_images)
+	: rect(NULL), N_images(_N_images), data(NULL), img_stride(0),
+	  star_stride(0), layout(LAYOUT_IMAGES), cumsum(NULL), cumsum_stars(NULL),
+	  cumsum_stride(0),
+	  capacity(0)
+{
 	img = new cv::Mat*[N_images];
 	for(size_t i=0; i<N_images; i++) {
 		img[i] = new cv::Mat;
 	}
-	rect = NULL;
 }
 
-TImgStack::TImgStack(size_t _N_images, TRect& _rect) {
-	N_images = _N_images;
+TImgStack::TImgStack(size_t _N_images, TRect& _rect)
+	: N_images(_N_images), data(NULL), img_stride(0),
+	  star_stride(0), layout(LAYOUT_IMAGES), cumsum(NULL), cumsum_stars(NULL),
+	  cumsum_stride(0),
+	  capacity(0)
+{
 	img = new cv::Mat*[N_images];
-	for(size_t i=0; i<N_images; i++) { img[i] = NULL; }
+	for(size_t i=0; i<N_images; i++) {
+		img[i] = new cv::Mat;
+	}
 	rect = new TRect(_rect);
+	allocate();
 }
 
 TImgStack::~TImgStack() {
 	if(img != NULL) {
 		for(size_t i=0; i<N_images; i++) {
-			if(img[i] != NULL) {
-				delete img[i];
-			}
+			delete img[i];
 		}
 		delete[] img;
 	}
 	if(rect != NULL) { delete rect; }
+	if(data != NULL) { free(data); }
+	clear_cumsum();
+}
+
+// (Re)allocate the buffer for the current # of images and rect, zero it
+// and point the views at it. The buffer is zeroed by the threads that
+// will later work on each image, so that on NUMA machines, its pages are
+// placed close to those threads.
+void TImgStack::allocate() {
+	clear_cumsum();
+	if(rect == NULL) { return; }
+
+	const size_t align = IMG_STACK_ALIGN / sizeof(floating_t);
+	const size_t N_pix = rect->N_bins[0] * rect->N_bins[1];
+	img_stride = align * ((N_pix + align - 1) / align);
+
+	size_t N_needed = img_stride * N_images;
+	if(N_needed > capacity) {
+		if(data != NULL) { free(data); }
+		void *ptr = NULL;
+		if(posix_memalign(&ptr, IMG_STACK_ALIGN, N_needed * sizeof(floating_t)) != 0) {
+			throw std::bad_alloc();
+		}
+		data = static_cast<floating_t*>(ptr);
+		capacity = N_needed;
+	}
+
+	#pragma omp parallel for schedule(static)
+	for(long i=0; i<(long)N_images; i++) {
+		std::memset(data + i*img_stride, 0, img_stride * sizeof(floating_t));
+	}
+
+	layout = LAYOUT_IMAGES;
+	set_views();
+}
+
+void TImgStack::set_views() {
+	for(size_t i=0; i<N_images; i++) {
+		if((data == NULL) || (layout != LAYOUT_IMAGES)) {
+			*(img[i]) = cv::Mat();
+		} else {
+			*(img[i]) = cv::Mat(rect->N_bins[0], rect->N_bins[1],
+			                    CV_FLOATING_TYPE, data + i*img_stride);
+		}
+	}
 }
 
 void TImgStack::resize(size_t _N_images) {
+	if(_N_images == N_images) {
+		allocate();
+		return;
+	}
+
 	if(img != NULL) {
 		for(size_t i=0; i<N_images; i++) {
-			if(img[i] != NULL) {
-				delete img[i];
-			}
+			delete img[i];
 		}
 		delete[] img;
 	}
-	// if(rect != NULL) { delete rect; }
 
 	N_images = _N_images;
 	img = new cv::Mat*[N_images];
 	for(size_t i=0; i<N_images; i++) {
 		img[i] = new cv::Mat;
 	}
+
+	allocate();
 }
 
 void TImgStack::cull(const std::vector<bool> &keep) {
 	assert(keep.size() == N_images);
 
+	set_layout(LAYOUT_IMAGES);
+	clear_cumsum();
+
 	size_t N_tmp = 0;
 	for(std::vector<bool>::const_iterator it = keep.begin(); it != keep.end(); ++it) {
 		if(*it) { N_tmp++; }
 	}
 
-	cv::Mat **img_tmp = new cv::Mat*[N_tmp];
-	size_t i = 0;
-	size_t k = 0;
-	for(std::vector<bool>::const_iterator it = keep.begin(); it != keep.end(); ++it, ++i) {
-		if(*it) {
-			img_tmp[k] = img[i];
+	// Move the images that are kept to the front of the buffer
+	if(data != NULL) {
+		size_t k = 0;
+		for(size_t i=0; i<N_images; i++) {
+			if(!keep[i]) { continue; }
+			if(k != i) {
+				std::memcpy(data + k*img_stride, data + i*img_stride,
+				            img_stride * sizeof(floating_t));
+			}
 			k++;
-		} else {
-			delete img[i];
 		}
 	}
 
-	delete[] img;
-	img = img_tmp;
+	for(size_t i=N_tmp; i<N_images; i++) {
+		delete img[i];
+	}
 	N_images = N_tmp;
+
+	set_views();
 }
 
 void TImgStack::crop(double x_min, double x_max, double y_min, double y_max) {
@@ -3056,12 +3763,29 @@ void TImgStack::crop(double x_min, double x_max, double y_min, double y_max) {
 	assert(x1 > x0);
 	assert(y1 > y0);
 
-	cv::Rect crop_region(y0, x0, y1-y0, x1-x0);
+	set_layout(LAYOUT_IMAGES);
+
+	// Repack the cropped images at the front of the buffer. Each row
+	// moves to a lower (or the same) address, and rows are moved in
+	// order, so no row is overwritten before it has been moved.
+	const size_t N_cols_old = rect->N_bins[1];
+	const size_t N_rows_new = x1 - x0;
+	const size_t N_cols_new = y1 - y0;
+	const size_t align = IMG_STACK_ALIGN / sizeof(floating_t);
+	const size_t stride_new = align * ((N_rows_new * N_cols_new + align - 1) / align);
 
-	for(int i=0; i<N_images; i++) {
-		*(img[i]) = (*(img[i]))(crop_region);
+	if(data != NULL) {
+		for(size_t i=0; i<N_images; i++) {
+			for(size_t r=0; r<N_rows_new; r++) {
+				std::memmove(data + i*stride_new + r*N_cols_new,
+				             data + i*img_stride + (r+x0)*N_cols_old + y0,
+				             N_cols_new * sizeof(floating_t));
+			}
+		}
 	}
 
+	img_stride = stride_new;
+
 	double xmin_new = rect->min[0] + x0 * rect->dx[0];
 	double xmax_new = rect->min[0] + x1 * rect->dx[0];
 
@@ -3079,18 +3803,46 @@ void TImgStack::crop(double x_min, double x_max, double y_min, double y_max) {
 	rect->max[1] = ymax_new;
 	rect->N_bins[0] = x1 - x0;
 	rect->N_bins[1] = y1 - y0;
+
+	clear_cumsum();
+	set_views();
 }
 
 void TImgStack::set_rect(TRect& _rect) {
+	bool same_shape = (rect != NULL)
+	                  && (rect->N_bins[0] == _rect.N_bins[0])
+	                  && (rect->N_bins[1] == _rect.N_bins[1]);
+
 	if(rect != NULL) {
 		delete rect;
 	}
 	rect = new TRect(_rect);
+
+	if(same_shape && (data != NULL)) {
+		set_layout(LAYOUT_IMAGES);
+		clear_cumsum();
+		set_views();
+	} else {
+		allocate();
+	}
 }
 
 void TImgStack::stack(cv::Mat& dest) {
-	if(N_images > 0) {
-		dest = *(img[0]);
+	if((N_images > 0) && (layout == LAYOUT_STAR_INNER)) {
+		const int N_rows = rect->N_bins[0];
+		const int N_cols = rect->N_bins[1];
+		dest.create(N_rows, N_cols, CV_FLOATING_TYPE);
+		for(int y=0; y<N_rows; y++) {
+			floating_t *dest_row = dest.ptr<floating_t>(y);
+			for(int x=0; x<N_cols; x++) {
+				const floating_t *p = stars_at(y, x);
+				floating_t sum = 0.;
+				for(size_t k=0; k<N_images; k++) { sum += p[k]; }
+				dest_row[x] = sum;
+			}
+		}
+	} else if(N_images > 0) {
+		img[0]->copyTo(dest);
 		for(size_t i=1; i<N_images; i++) {
 			dest += *(img[i]);
 		}
@@ -3100,16 +3852,172 @@ void TImgStack::stack(cv::Mat& dest) {
 }
 
 bool TImgStack::initialize_to_zero(unsigned int img_idx) {
-	if(img_idx > N_images) { return false; }
-	if(rect == NULL) { return false; }
-	if(img[img_idx] == NULL) {
-		img[img_idx] = new cv::Mat;
-	}
-	*(img[img_idx]) = cv::Mat::zeros(rect->N_bins[0], rect->N_bins[1], CV_FLOATING_TYPE);
+	if(img_idx >= N_images) { return false; }
+	if((rect == NULL) || (data == NULL)) { return false; }
+	assert(layout == LAYOUT_IMAGES);
+	assert((cumsum == NULL) && (cumsum_stars == NULL));
+	std::memset(data + img_idx*img_stride, 0, img_stride * sizeof(floating_t));
 	return true;
 }
 
 
+void TImgStack::downsample(unsigned int factor, TImgStack& coarse) const {
+	assert(layout == LAYOUT_IMAGES);
+	assert((rect != NULL) && (factor >= 1));
+
+	const int f = factor;
+	const int N_rows = rect->N_bins[0];
+	const int N_cols = rect->N_bins[1];
+	assert((N_rows % f == 0) && (N_cols % f == 0));
+
+	double min[2] = {rect->min[0], rect->min[1]};
+	double max[2] = {rect->max[0], rect->max[1]};
+	uint32_t N_bins[2] = {(uint32_t)(N_rows / f), (uint32_t)(N_cols / f)};
+	TRect coarse_rect(min, max, N_bins);
+
+	coarse.resize(N_images);
+	coarse.set_rect(coarse_rect);
+
+	if((data == NULL) || (N_images == 0)) { return; }
+
+	const int N_rows_c = N_bins[0];
+	const int N_cols_c = N_bins[1];
+
+	// los_integral samples pixel j at min + j*dx, on both axes (in
+	// distance, through the column index). Coarse pixel j must then
+	// represent fine pixel f*j, so the fine pixels are binned with a
+	// tent filter centered there, rather than with a box, which would
+	// shift the coarse stack by (f-1)/2 fine pixels. Pixels beyond the
+	// edges are clamped.
+	std::vector<floating_t> w(2*f-1);
+	for(int d=-(f-1); d<f; d++) {
+		w[d+f-1] = 1. - (floating_t)std::abs(d) / (floating_t)f;
+	}
+
+	// The line integral samples one pixel per distance bin, so distance
+	// bins are summed (the weights add up to f). Reddening bins are
+	// averaged.
+	const floating_t norm = 1. / (floating_t)f;
+
+	#pragma omp parallel for schedule(static)
+	for(size_t i=0; i<N_images; i++) {
+		const floating_t *src = data + i*img_stride;
+		floating_t *dest = coarse.data + i*coarse.img_stride;
+
+		// Bin along distance, for every fine row
+		std::vector<floating_t> tmp(N_rows * N_cols_c);
+		for(int y=0; y<N_rows; y++) {
+			const floating_t *src_row = src + y*N_cols;
+			for(int xc=0; xc<N_cols_c; xc++) {
+				floating_t sum = 0.;
+				for(int d=-(f-1); d<f; d++) {
+					int x = std::min(std::max(f*xc + d, 0), N_cols-1);
+					sum += w[d+f-1] * src_row[x];
+				}
+				tmp[y*N_cols_c + xc] = sum;
+			}
+		}
+
+		// Bin along reddening
+		for(int yc=0; yc<N_rows_c; yc++) {
+			floating_t *dest_row = dest + yc*N_cols_c;
+			for(int xc=0; xc<N_cols_c; xc++) { dest_row[xc] = 0.; }
+
+			for(int d=-(f-1); d<f; d++) {
+				int y = std::min(std::max(f*yc + d, 0), N_rows-1);
+				const floating_t *tmp_row = &(tmp[y*N_cols_c]);
+				for(int xc=0; xc<N_cols_c; xc++) {
+					dest_row[xc] += w[d+f-1] * tmp_row[xc];
+				}
+			}
+
+			for(int xc=0; xc<N_cols_c; xc++) { dest_row[xc] *= norm; }
+		}
+	}
+}
+
+void TImgStack::build_cumsum() {
+	clear_cumsum();
+	if((rect == NULL) || (data == NULL)) { return; }
+
+	const size_t N_rows = rect->N_bins[0];
+	const size_t N_cols = rect->N_bins[1];
+
+	// In LAYOUT_IMAGES, an extra row of zeros, above the top row, so
+	// that interpolating between the top row and the next one stays
+	// inside the buffer. The discrete sampler (LAYOUT_STAR_INNER) only
+	// looks up whole rows, and does not need it.
+	void *ptr = NULL;
+
+	if(layout == LAYOUT_STAR_INNER) {
+		const size_t align = IMG_STACK_ALIGN / sizeof(double);
+		cumsum_stride = align * ((N_images + align - 1) / align);
+		size_t N_needed = N_rows * (N_cols+1) * cumsum_stride;
+
+		if(posix_memalign(&ptr, IMG_STACK_ALIGN, N_needed * sizeof(double)) != 0) {
+			throw std::bad_alloc();
+		}
+		cumsum_stars = static_cast<double*>(ptr);
+
+		// Rows are independent. Column x holds the sums of columns [0, x).
+		#pragma omp parallel for schedule(static)
+		for(long y=0; y<(long)N_rows; y++) {
+			double *dest = cumsum_stars + y*cumsum_stride;
+			for(size_t k=0; k<cumsum_stride; k++) { dest[k] = 0.; }
+
+			for(size_t x=1; x<=N_cols; x++) {
+				const double *prev = dest;
+				dest = cumsum_stars + (x*N_rows + y)*cumsum_stride;
+
+				const floating_t *src = stars_at(y, x-1);
+				#pragma omp simd
+				for(size_t k=0; k<N_images; k++) {
+					dest[k] = prev[k] + (double)src[k];
+				}
+				for(size_t k=N_images; k<cumsum_stride; k++) { dest[k] = 0.; }
+			}
+		}
+		return;
+	}
+
+	cumsum_stride = (N_rows+1) * (N_cols+1);
+	size_t N_needed = N_images * cumsum_stride;
+
+	if(posix_memalign(&ptr, IMG_STACK_ALIGN, N_needed * sizeof(floating_t)) != 0) {
+		throw std::bad_alloc();
+	}
+	cumsum = static_cast<floating_t*>(ptr);
+
+	#pragma omp parallel for schedule(static)
+	for(long i=0; i<(long)N_images; i++) {
+		floating_t *pad = cumsum + i*cumsum_stride + N_rows*(N_cols+1);
+		for(size_t x=0; x<=N_cols; x++) { pad[x] = 0.; }
+
+		for(size_t y=0; y<N_rows; y++) {
+			const floating_t *src = data + i*img_stride + y*N_cols;
+			floating_t *dest = cumsum + i*cumsum_stride + y*(N_cols+1);
+			double sum = 0.;
+			dest[0] = 0.;
+			for(size_t x=0; x<N_cols; x++) {
+				sum += src[x];
+				dest[x+1] = sum;
+			}
+		}
+	}
+}
+
+void TImgStack::clear_cumsum() {
+	if(cumsum != NULL) {
+		free(cumsum);
+		cumsum = NULL;
+	}
+	if(cumsum_stars != NULL) {
+		free(cumsum_stars);
+		cumsum_stars = NULL;
+	}
+	cumsum_stride = 0;
+}
+
 void TImgStack::smooth(std::vector<double> sigma, double n_sigma) {
 	const int N_rows = rect->N_bins[0];
 	const int N_cols = rect->N_bins[1];
@@ -3117,18 +4025,20 @@ void TImgStack::smooth(std::vector<double> sigma, double n_sigma) {
 	assert(sigma.size() == N_rows);
 	assert(n_sigma > 0);
 
-	// Create copy of each image
-	cv::Mat **img_s = new cv::Mat*[N_images];
-	for(int i=0; i<N_images; i++) {
-		if(img[i] == NULL) {
-			img_s[i] = NULL;
-		} else {
-			img_s[i] = new cv::Mat(img[i]->clone());
-		}
+	if(data == NULL) { return; }
+
+	set_layout(LAYOUT_IMAGES);
+
+	// Smoothed images are written to a second buffer of the same layout
+	void *ptr = NULL;
+	if(posix_memalign(&ptr, IMG_STACK_ALIGN, capacity * sizeof(floating_t)) != 0) {
+		throw std::bad_alloc();
 	}
+	floating_t *data_s = static_cast<floating_t*>(ptr);
 
 	// Source and destination rows for convolution
-	floating_t *src_img_row_up, *src_img_row_down, *dest_img_row;
+	const floating_t *src_img, *src_img_row_up, *src_img_row_down;
+	floating_t *dest_img_row;
 	int src_row_idx_up, src_row_idx_down;
 
 	// Weight applied to each row
@@ -3155,47 +4065,124 @@ void TImgStack::smooth(std::vector<double> sigma, double n_sigma) {
 
 		a = 1. / c;
 
-		for(int i=0; i<N_images; i++) {
-			img_s[i]->row(dest_row_idx) *= a;
-		}
-
-		// Loop over row offsets
 		for(int m=1; m<m_max; m++) {
 			dc[m] *= a;
-			src_row_idx_up = dest_row_idx + m;
-			src_row_idx_down = dest_row_idx - m;
-
-			if(src_row_idx_up >= N_rows) { src_row_idx_up = N_rows - 1; }
-			if(src_row_idx_down < 0) { src_row_idx_down = 0; }
-
-			// Loop over images
-			for(int i=0; i<N_images; i++) {
-				if(img[i] != NULL) {
-					dest_img_row = img_s[i]->ptr<floating_t>(dest_row_idx);
-					src_img_row_up = img[i]->ptr<floating_t>(src_row_idx_up);
-					src_img_row_down = img[i]->ptr<floating_t>(src_row_idx_down);
-
-					// Loop over columns
-					for(int col=0; col<N_cols; col++) {
-						dest_img_row[col] += dc[m] * (src_img_row_up[col] + src_img_row_down[col]);
-					}
+		}
+
+		// Loop over images
+		for(size_t i=0; i<N_images; i++) {
+			src_img = data + i*img_stride;
+			dest_img_row = data_s + i*img_stride + dest_row_idx*N_cols;
+
+			const floating_t *src_img_row = src_img + dest_row_idx*N_cols;
+			for(int col=0; col<N_cols; col++) {
+				dest_img_row[col] = a * src_img_row[col];
+			}
+
+			// Loop over row offsets
+			for(int m=1; m<m_max; m++) {
+				src_row_idx_up = dest_row_idx + m;
+				src_row_idx_down = dest_row_idx - m;
+
+				if(src_row_idx_up >= N_rows) { src_row_idx_up = N_rows - 1; }
+				if(src_row_idx_down < 0) { src_row_idx_down = 0; }
+
+				src_img_row_up = src_img + src_row_idx_up*N_cols;
+				src_img_row_down = src_img + src_row_idx_down*N_cols;
+
+				// Loop over columns
+				for(int col=0; col<N_cols; col++) {
+					dest_img_row[col] += dc[m] * (src_img_row_up[col] + src_img_row_down[col]);
 				}
 			}
 		}
 	}
 
 	// Switch out smoothed images for old images
-	for(int i=0; i<N_images; i++) {
-		if(img[i] != NULL) { delete img[i]; }
-	}
-	delete[] img;
-
-	img = img_s;
+	free(data);
+	data = data_s;
+	clear_cumsum();
+	set_views();
 
 	// Cleanup
 	delete[] dc;
 }
 
+void TImgStack::set_layout(TLayout _layout) {
+	if(_layout == layout) { return; }
+
+	clear_cumsum();
+
+	if(data == NULL) {
+		layout = _layout;
+		set_views();
+		return;
+	}
+
+	const size_t N_rows = rect->N_bins[0];
+	const size_t N_cols = rect->N_bins[1];
+	const size_t align = IMG_STACK_ALIGN / sizeof(floating_t);
+
+	size_t N_needed;
+	if(_layout == LAYOUT_STAR_INNER) {
+		star_stride = align * ((N_images + align - 1) / align);
+		N_needed = star_stride * N_rows * N_cols;
+	} else {
+		N_needed = img_stride * N_images;
+	}
+	if(N_needed < align) { N_needed = align; }
+
+	void *ptr = NULL;
+	if(posix_memalign(&ptr, IMG_STACK_ALIGN, N_needed * sizeof(floating_t)) != 0) {
+		throw std::bad_alloc();
+	}
+	floating_t *data_new = static_cast<floating_t*>(ptr);
+
+	// Transpose in blocks of one cache line worth of stars, so that
+	// each pass over a row of the images fills whole cache lines on the
+	// star-inner side. Padding is zeroed.
+	if(_layout == LAYOUT_STAR_INNER) {
+		#pragma omp parallel for schedule(static)
+		for(long y=0; y<(long)N_rows; y++) {
+			for(size_t k0=0; k0<star_stride; k0+=align) {
+				size_t k1 = std::min(k0 + align, N_images);
+				for(size_t x=0; x<N_cols; x++) {
+					floating_t *dest = data_new + (x*N_rows + y) * star_stride;
+					for(size_t k=k0; k<k1; k++) {
+						dest[k] = data[k*img_stride + y*N_cols + x];
+					}
+					for(size_t k=k1; k<k0+align; k++) {
+						dest[k] = 0.;
+					}
+				}
+			}
+		}
+	} else {
+		#pragma omp parallel for schedule(static)
+		for(long y=0; y<(long)N_rows; y++) {
+			for(size_t k=0; k<N_images; k++) {
+				floating_t *dest_row = data_new + k*img_stride + y*N_cols;
+				for(size_t x=0; x<N_cols; x++) {
+					dest_row[x] = data[(x*N_rows + y) * star_stride + k];
+				}
+			}
+		}
+
+		const size_t N_pix = N_rows * N_cols;
+		for(size_t k=0; k<N_images; k++) {
+			std::memset(data_new + k*img_stride + N_pix, 0,
+			            (img_stride - N_pix) * sizeof(floating_t));
+		}
+	}
+
+	free(data);
+	data = data_new;
+	capacity = N_needed;
+	layout = _layout;
+
+	set_views();
+}
+
 // void shift_image_vertical(cv::Mat& img, int n_pix) {
 //
 // }
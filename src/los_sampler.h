@@ -32,6 +32,7 @@
 #include <map>
 #include <string>
 #include <cstring>
+#include <cstdlib>
 #include <sstream>
 #include <math.h>
 #include <numeric>
@@ -51,6 +52,7 @@
 #include "affine_sampler.h"
 #include "chain.h"
 #include "binner.h"
+#include "pipeline.h"
 
 
 // Parameters commonly passed to sampling routines
@@ -60,19 +62,52 @@ struct TMCMCOptions {
 	double p_replacement;
 	unsigned int N_runs;
 
+	// If true, stars are handed out to threads as independent tasks,
+	// and the runs of each star's sampler are executed serially within
+	// its task. Otherwise, stars are processed one at a time, with the
+	// runs spread across threads.
+	bool parallel_stars;
+
 	TMCMCOptions(unsigned int _steps, unsigned int _samplers,
-	             double _p_replacement, unsigned int _N_runs)
+	             double _p_replacement, unsigned int _N_runs,
+	             bool _parallel_stars=false)
 		: steps(_steps), samplers(_samplers),
-		  p_replacement(_p_replacement), N_runs(_N_runs)
+		  p_replacement(_p_replacement), N_runs(_N_runs),
+		  parallel_stars(_parallel_stars)
 	{}
 };
 
+// A stack of (reddening, distance) images, one per star. The images
+// are stored in a single contiguous buffer, of shape (star, E, DM),
+// with image i beginning at data + i * img_stride. Each image starts on
+// a cache-line boundary. The matrices in img are views into the buffer,
+// so they must be written in place (e.g., with copyTo or setTo), rather
+// than assigned new matrices.
+//
+// The buffer can instead be laid out as (DM, E, star), so that the
+// values of one pixel for all stars are contiguous (see set_layout).
+// In this layout, the views in img are empty, and pixels are accessed
+// with stars_at.
 struct TImgStack {
+	enum TLayout {
+		LAYOUT_IMAGES,		// (star, E, DM)
+		LAYOUT_STAR_INNER	// (DM, E, star)
+	};
+
 	cv::Mat **img;
 	TRect *rect;
 
 	size_t N_images;
 
+	floating_t *data;	// NULL until both N_images and rect are known
+	size_t img_stride;	// # of elements between consecutive images
+	size_t star_stride;	// # of elements between pixels (star-inner layout)
+	TLayout layout;
+
+	floating_t *cumsum;		// Cumulative sums along distance (see build_cumsum)
+	double *cumsum_stars;	// The same, in LAYOUT_STAR_INNER
+	size_t cumsum_stride;	// # of elements between images in cumsum (or pixels, in cumsum_stars)
+
 	TImgStack(size_t _N_images);
 	TImgStack(size_t _N_images, TRect &_rect);
 	~TImgStack();
@@ -80,17 +115,94 @@ struct TImgStack {
 	void cull(const std::vector<bool>& keep);
 	void crop(double x_min, double x_max, double y_min, double y_max);
 
+	// Both zero all images if the shape of the stack changes. Either
+	// way, the stack is left in LAYOUT_IMAGES, without cumulative sums.
 	void resize(size_t _N_images);
 	void set_rect(TRect& _rect);
+
 	void stack(cv::Mat& dest);
 
+	// Zero one image. Only touches that image, so different images can
+	// be zeroed from different threads. The stack must already be
+	// allocated, in LAYOUT_IMAGES, without cumulative sums (e.g., after
+	// set_rect or resize).
 	bool initialize_to_zero(unsigned int img_idx);
 
 	void smooth(std::vector<double> sigma, double n_sigma=5);
+
+	// Bin by <factor> along both axes into <coarse>. Reddening pixels
+	// are averaged and distance pixels are summed, so that line
+	// integrals through <coarse> approximate those through this stack.
+	// Coarse pixel j is centered on pixel <factor>*j, so both stacks
+	// share the same rect bounds. Both dimensions must be divisible by
+	// <factor>.
+	void downsample(unsigned int factor, TImgStack& coarse) const;
+
+	// Rearrange the buffer into the given layout. Does nothing if the
+	// stack is already in that layout. All other methods that modify
+	// the stack first return it to LAYOUT_IMAGES.
+	void set_layout(TLayout _layout);
+
+	// Sum each row of each image along distance, so that the sum of
+	// pixels [x0, x1) of row y of image i is
+	//   cumsum[i*cumsum_stride + y*(N_cols+1) + x1] - (same at x0)
+	// in LAYOUT_IMAGES, or
+	//   cumsum_stars_at(y, x1)[i] - cumsum_stars_at(y, x0)[i]
+	// in LAYOUT_STAR_INNER.
+	//
+	// The LAYOUT_IMAGES sums are stored as floating_t (accumulated in
+	// double). A difference of two of them is only accurate to about
+	// 1e-7 of the row's running total, not of the pixels being summed,
+	// so a segment that follows a bright peak in the same row can come
+	// out as zero. The cloud model tolerates this, since it floors each
+	// star's likelihood at p0/Z. The discrete sampler resolves line
+	// integrals far below a row's peak (down to its softening, ~1e-12),
+	// so its star-inner sums are kept in double.
+	//
+	// The sums are not updated when the images change: methods that
+	// modify the stack (or its layout) discard them, and images written
+	// to directly (through img) require the sums to be rebuilt.
+	void build_cumsum();
+	void clear_cumsum();
+
+	// Cumulative sums of row y, up to column x, of every star, in
+	// LAYOUT_STAR_INNER (0 <= x <= N_cols)
+	inline const double* cumsum_stars_at(int y, int x) const {
+		return cumsum_stars + (x * rect->N_bins[0] + y) * cumsum_stride;
+	}
+
+	// Pointer to pixel (y, x) of every star, in LAYOUT_STAR_INNER
+	inline const floating_t* stars_at(int y, int x) const {
+		return data + (x * rect->N_bins[0] + y) * star_stride;
+	}
+
+private:
+	size_t capacity;	// # of elements allocated in data
+
+	void allocate();
+	void set_views();
+};
+
+// Line integrals through each region of the piecewise-linear profiles
+// most recently evaluated by one thread. A proposal that changes only
+// one or two Delta E(B-V)s (see set_local_move_origin) then only
+// recomputes the regions whose paths changed.
+struct TLOSIntCache {
+	unsigned int N_entries;
+	std::vector<double> state;		// log(Delta E(B-V)) of each entry
+	std::vector<float> partial;		// Integrals through each region, for each entry
+	std::vector<bool> filled;
+	unsigned int next;				// Entry to overwrite next
+
+	std::vector<double> origin;		// State that the next proposal was made from
+	bool has_origin;
+
+	// Statistics
+	uint64_t N_evals, N_regions_evaluated;
 };
 
 struct TLOSMCMCParams {
-	TImgStack *img_stack;
+	TImgStack *img_stack;	// Stack at the current resolution (see set_img_level)
 	std::vector<double> p0_over_Z, ln_p0_over_Z, inv_p0_over_Z;
 	double p0, lnp0;
 
@@ -133,6 +245,41 @@ struct TLOSMCMCParams {
 	double* get_line_int(unsigned int thread_num);
 	float* get_Delta_EBV(unsigned int thread_num);
 
+	// Keep the per-region line integrals of the last <N_entries> states
+	// evaluated by each thread (0 turns the cache off). The # of entries
+	// may be reduced, to limit memory use.
+	void init_los_int_cache(unsigned int N_entries);
+	bool los_int_cache_enabled() const;
+
+	// Mark the next state evaluated on this thread as a local
+	// modification of <logEBV>
+	void set_local_move_origin(const double *const logEBV);
+
+	// Line integrals for the state <logEBV>, using the cache
+	void los_integral_cached(const double *const logEBV,
+	                         const float *const Delta_EBV,
+	                         double *const ret);
+
+	// Fraction of region integrals that were recomputed
+	double los_int_cache_work_fraction() const;
+
+	// Coarse-to-fine fitting. Level l binds img_stack to a copy of the
+	// full-resolution stack, binned by 2^l along both axes. Levels are
+	// added up to <max_level>, for as long as the binning divides the
+	// stack evenly (with a whole # of pixels per distance region).
+	// Returns the # of coarse levels available.
+	unsigned int build_img_pyramid(unsigned int max_level);
+	void clear_img_pyramid();	// Also returns to full resolution
+	void set_img_level(unsigned int level);
+	unsigned int get_img_level() const;
+	unsigned int get_N_img_levels() const;	// Including full resolution
+
+private:
+	std::vector<TLOSIntCache> los_int_cache;	// One per thread
+
+	TImgStack *img_stack_full;
+	std::vector<std::shared_ptr<TImgStack> > img_pyramid;	// Levels 1, 2, ...
+	unsigned int img_level;
 };
 
 
@@ -140,13 +287,15 @@ struct TDiscreteLosMcmcParams {
     TImgStack* img_stack;   // Stack of (distance, reddening) posteriors for stars
     double y_zero_idx;		// y-index corresponding to zero reddening
 
-    double* line_int;       // Line integral through line of sight for each thread
-    int16_t* E_pix_idx;     // LOS reddening profile, in the form of the pixel y-index at each distance (for each thread)
-
     unsigned int n_dists, n_E;  // # of distance and reddening pixels, respectively
     unsigned int N_runs;    // # of times to repeat inference (to check convergence)
 	unsigned int N_threads; // # of threads (can be less than # of runs)
 
+	// Parallel tempering: # of temperatures per run (1 = no tempering),
+	// and the inverse temperature of the hottest chain
+	unsigned int n_temperatures;
+	double beta_min;
+
 	// Priors on Delta E in each distance bin
 	double mu_log_dE, sigma_log_dE;
 	double mu_log_dy, inv_sigma_log_dy;
@@ -160,11 +309,8 @@ struct TDiscreteLosMcmcParams {
 						   unsigned int _N_threads);
 	~TDiscreteLosMcmcParams();
 
-	// Access fit information for one thread
-	double* get_line_int(unsigned int thread_num);
-	int16_t* get_E_pix_idx(unsigned int thread_num);
-
-	// Line-of-sight integrals
+	// Line-of-sight integrals (these and the shift proposals require
+	// TImgStack::build_cumsum)
 	void los_integral_discrete(const int16_t *const y_idx,
 							   double *const line_int_ret);
 
@@ -224,7 +370,22 @@ struct TDiscreteLosMcmcParams {
 		const int16_t dy,
 	    const int16_t *const y_idx_los_old);
 
+	// Change in line integrals when y_idx is shifted by dy over the
+	// distance bins [x_begin, x_end), computed one run of constant
+	// y_idx at a time (requires TImgStack::build_cumsum)
+	void los_integral_diff_shift_runs(
+		const int x_begin,
+		const int x_end,
+		const int16_t dy,
+		const int16_t *const y_idx_old,
+		double *const delta_line_int_ret);
+
 	// Miscellaneous functions
+	static int profile_run_end(
+		const int16_t *const y_idx,
+		const int x_begin,
+		const int x_end);
+
 	void los_integral_diff_shift_compare_operations(
 		const int16_t x_idx,
 		const int16_t dy,
@@ -232,7 +393,9 @@ struct TDiscreteLosMcmcParams {
 		unsigned int& n_eval_diff,
 		unsigned int& n_eval_cumulative);
 
-    void guess_EBV_profile_discrete(int16_t *const y_idx_ret, gsl_rng *r);
+    // Random profile reaching roughly <EBV_max> (see guess_EBV_max)
+    void guess_EBV_profile_discrete(int16_t *const y_idx_ret,
+                                    double EBV_max, gsl_rng *r);
 
 	void initialize_priors(
 		TGalacticLOSModel& gal_los_model,
@@ -273,7 +436,7 @@ void test_extinction_profiles(TLOSMCMCParams &params);
 
 void sample_los_extinction(const std::string& out_fname, const std::string& group_name,
                            TMCMCOptions &options, TLOSMCMCParams &params,
-                           int verbosity=1);
+                           int verbosity=1, TWriteQueue *write_queue=NULL);
 
 double lnp_los_extinction(const double *const Delta_EBV, unsigned int N_regions, TLOSMCMCParams &params);
 
@@ -284,6 +447,18 @@ void gen_rand_los_extinction(double *const Delta_EBV, unsigned int N, gsl_rng *r
 void los_integral(TImgStack& img_stack, const double *const subpixel, double *const ret,
                   const float *const Delta_EBV, unsigned int N_regions);
 
+// Integrals through regions [i_begin, i_end) (numbered from 1) only. The
+// integral of star k through region i is stored, unnormalized, in
+// partial[(i-1)*N_images + k]. los_integral_sum turns the integrals
+// through all regions into the normalized line integrals.
+void los_integral_partial(TImgStack& img_stack, const double *const subpixel,
+                          float *const partial, const float *const Delta_EBV,
+                          unsigned int N_regions, unsigned int i_begin,
+                          unsigned int i_end);
+
+void los_integral_sum(const float *const partial, size_t N_images,
+                      unsigned int N_regions, double *const ret);
+
 double guess_EBV_max(TImgStack &img_stack);
 
 void guess_EBV_profile(TMCMCOptions &options, TLOSMCMCParams &params, int verbosity=1);
@@ -302,7 +477,8 @@ double step_one_Delta_EBV(double *const _X, double *const _Y, unsigned int _N, g
 // Sample cloud model
 void sample_los_extinction_clouds(const std::string& out_fname, const std::string& group_name,
                                   TMCMCOptions &options, TLOSMCMCParams &params,
-                                  unsigned int N_clouds, int verbosity=1);
+                                  unsigned int N_clouds, int verbosity=1,
+                                  TWriteQueue *write_queue=NULL);
 
 double lnp_los_extinction_clouds(const double* x, unsigned int N, TLOSMCMCParams& params);
 
@@ -312,10 +488,13 @@ void los_integral_clouds(TImgStack &img_stack, const double *const subpixel, dou
                          const double *const logDelta_EBV, unsigned int N_clouds);
 
 
-// Sample discrete line-of-sight model
+// Sample discrete line-of-sight model. Runs params.N_runs independent
+// replicas in parallel, merges them and checks their convergence. Each
+// replica may use parallel tempering (see params.n_temperatures), with
+// its chains at different temperatures run on separate threads.
 void sample_los_extinction_discrete(const std::string& out_fname, const std::string& group_name,
                            TMCMCOptions &options, TDiscreteLosMcmcParams &params,
-                           int verbosity);
+                           int verbosity, TWriteQueue *write_queue=NULL);
 
 
 #endif // _LOS_SAMPLER_H__
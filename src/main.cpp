@@ -25,6 +25,9 @@
 #include <iostream>
 #include <iomanip>
 #include <ctime>
+#include <mutex>
+#include <set>
+#include <algorithm>
 
 #include "cpp_utils.h"
 #include "model.h"
@@ -34,397 +37,660 @@
 #include "star_exact.h"
 #include "bayestar_config.h"
 #include "program_opts.h"
+#include "manifest.h"
+#include "pipeline.h"
 
 using namespace std;
 
 
-int main(int argc, char **argv) {
-	gsl_set_error_handler_off();
+/*
+ *  Models shared by all pixels. These are only read from while
+ *  pixels are being processed, so concurrently running pixels
+ *  can share one copy.
+ */
+struct TPixelModels {
+	TStellarModel *emplib;
+	TSyntheticStellarModel *synthlib;
+	TExtinctionModel *ext_model;
+	TEBVSmoothing *EBV_smoothing;
+};
 
-	/*
-	 *  Parse commandline arguments
-	 */
 
-	TProgramOpts opts;
-	int parse_res = get_program_opts(argc, argv, opts);
-	if(parse_res <= 0) { return parse_res; }
+/*
+ *  The datasets that a completed pixel holds, given the run options.
+ */
+void expected_pixel_datasets(const TProgramOpts &opts, vector<string> &dsets) {
+	dsets.clear();
+	dsets.push_back("stellar chains");
+	if(opts.save_surfs) { dsets.push_back("stellar pdfs"); }
+	if(opts.N_clouds != 0) { dsets.push_back("clouds"); }
+	if(opts.N_regions != 0) { dsets.push_back("los"); }
+	if(opts.discrete_los) { dsets.push_back("discrete-los"); }
+}
 
-	time_t tmp_time = time(0);
-	char * dt = ctime(&tmp_time);
-	cout << "# Start time: " << dt;
 
-	timespec prog_start_time;
-	clock_gettime(CLOCK_MONOTONIC, &prog_start_time);
+/*
+ *  The expected datasets, as recorded with the completion manifest
+ *  (see manifest.h). A manifest recorded for a different set of datasets
+ *  cannot be used to skip pixels.
+ */
+string pixel_datasets_key(const TProgramOpts &opts) {
+	vector<string> dsets;
+	expected_pixel_datasets(opts, dsets);
+
+	string key;
+	for(vector<string>::const_iterator it = dsets.begin(); it != dsets.end(); ++it) {
+		if(it != dsets.begin()) { key += ", "; }
+		key += *it;
+	}
+	return key;
+}
 
 
-	/*
-	 *  MCMC Options
-	 */
+/*
+ *  Check whether the output file contains all the datasets expected
+ *  for the given pixel. This is only needed when the output file has no
+ *  usable completion manifest (see manifest.h).
+ */
+bool pixel_complete_in_output(const TProgramOpts &opts, H5::H5File *out_file,
+                              const string &pix_name) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
+	H5::Group *pix_group = H5Utils::openGroup(
+		out_file,
+		pix_name,
+		H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
+	);
+
+	if(pix_group == NULL) { return false; }
+
+	vector<string> dsets;
+	expected_pixel_datasets(opts, dsets);
+
+	bool complete = true;
+	for(vector<string>::const_iterator it = dsets.begin(); it != dsets.end(); ++it) {
+		if(!H5Utils::dataset_exists(*it, pix_group)) {
+			complete = false;
+			break;
+		}
+	}
 
-	TMCMCOptions star_options(opts.star_steps, opts.star_samplers, opts.star_p_replacement, opts.N_runs);
-	TMCMCOptions cloud_options(opts.cloud_steps, opts.cloud_samplers, opts.cloud_p_replacement, opts.N_runs);
-	TMCMCOptions los_options(opts.los_steps, opts.los_samplers, opts.los_p_replacement, opts.N_runs);
+	delete pix_group;
 
-	TMCMCOptions discrete_los_options(opts.discrete_steps, 1, 0., opts.N_runs);    // TODO: Create commandline options for this
+	return complete;
+}
 
 
-	/*
-	 *  Construct models
-	 */
+/*
+ *  Determine which pixels still have to be processed. Pixels listed in
+ *  the output file's completion manifest are skipped, as long as the
+ *  manifest was recorded for the datasets that the current options
+ *  produce. Otherwise, each pixel is probed for those datasets, and the
+ *  manifest is rebuilt. Any partial output from other pixels is removed,
+ *  so that it can be regenerated.
+ */
+void select_incomplete_pixels(const TProgramOpts &opts,
+                              const vector<string> &pix_name,
+                              vector<string> &pix_todo) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
 
-	TStellarModel *emplib = NULL;
-	TSyntheticStellarModel *synthlib = NULL;
-	if(opts.synthetic) {
-		synthlib = new TSyntheticStellarModel(DATADIR "PS1templates.h5");
-	} else {
-		emplib = new TStellarModel(opts.LF_fname, opts.template_fname);
-	}
-	TExtinctionModel ext_model(opts.ext_model_fname);
+	pix_todo.clear();
 
-	TEBVSmoothing EBV_smoothing(opts.smoothing_alpha_coeff,
-	                            opts.smoothing_beta_coeff,
-	                            opts.pct_smoothing_min,
-	                            opts.pct_smoothing_max);
+	H5::H5File *out_file = H5Utils::openFile(
+		opts.output_fname,
+		H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
+	);
 
-	/*
-	 *  Execute
-	 */
+	if(out_file == NULL) {
+		pix_todo = pix_name;
+		return;
+	}
 
-	omp_set_num_threads(opts.N_threads);
+	std::set<string> completed;
+	bool have_manifest = read_pixel_manifest(out_file, completed);
 
-	// Get list of pixels in input file
-	vector<string> pix_name;
-	get_input_pixels(opts.input_fname, pix_name);
-	cout << "# " << pix_name.size() << " pixels in input file." << endl << endl;
+	string datasets_key = pixel_datasets_key(opts);
+	string manifest_datasets;
+	bool use_manifest = have_manifest
+	                    && read_pixel_manifest_datasets(out_file, manifest_datasets)
+	                    && (manifest_datasets == datasets_key);
 
-	// Remove the output file
-	if(opts.clobber) {
-		remove(opts.output_fname.c_str());
+	if(!use_manifest) {
+		if(have_manifest) {
+			cout << "# Completion manifest does not match the datasets expected "
+			     << "with these options (" << datasets_key << "). "
+			     << "Checking pixels individually." << endl;
+		}
+		create_pixel_manifest(out_file, datasets_key);
 	}
 
-	H5::Exception::dontPrint();
+	for(vector<string>::const_iterator it = pix_name.begin(); it != pix_name.end(); ++it) {
+		bool complete;
+		if(use_manifest) {
+			complete = (completed.count(*it) != 0);
+		} else {
+			// Probe the pixel's group, and record the result, so that
+			// the next restart can use the manifest
+			complete = pixel_complete_in_output(opts, out_file, *it);
+			if(complete) { append_pixel_manifest(out_file, *it); }
+		}
 
-	// Run each pixel
-	timespec t_start, t_mid, t_end;
+		if(complete) { continue; }
 
-	double t_tot, t_star;
-	unsigned int pixel_list_no = 0;
+		pix_todo.push_back(*it);
 
-	for(vector<string>::iterator it = pix_name.begin(); it != pix_name.end(); ++it, pixel_list_no++) {
-		clock_gettime(CLOCK_MONOTONIC, &t_start);
+		// If pixel is missing data, remove it, so that it can be regenerated
+		if(H5Utils::group_exists(*it, out_file)) {
+			try {
+				out_file->unlink(*it);
+			} catch(H5::FileIException unlink_err) {
+				cout << "Unable to remove group: '" << *it << "'"
+					 << endl;
+			}
+		}
+	}
 
-		cout << "# Pixel: " << *it
-			<< " (" << pixel_list_no + 1 << " of " << pix_name.size() << ")"
-			<< endl;
+	delete out_file;
+}
 
-		TStellarData stellar_data(opts.input_fname, *it, opts.err_floor);
-		TGalacticLOSModel los_model(
-			stellar_data.l,
-			stellar_data.b,
-			opts.gal_struct_params
-		);
 
-		cout << "# HEALPix index: " << stellar_data.healpix_index
-			 << " (nside = " << stellar_data.nside << ")" << endl;
-		cout << "# (l, b) = "
-			 << stellar_data.l << ", " << stellar_data.b << endl;
-		if(opts.SFD_prior) {
-			cout << "# E(B-V)_SFD = " << stellar_data.EBV << endl;
+/*
+ *  Select the pixels belonging to one shard of the input. Pixels are
+ *  assigned, largest first, to whichever shard has the fewest stars so
+ *  far, so that the shards take a similar amount of time to run. The
+ *  assignment depends only on the input file, so every shard computes
+ *  the same partition. Pixels keep their input-file order within a shard.
+ */
+void select_shard_pixels(const TProgramOpts &opts,
+                         const vector<string> &pix_name,
+                         vector<string> &pix_shard) {
+	pix_shard.clear();
+
+	vector<size_t> n_stars;
+	get_input_pixel_sizes(opts.input_fname, pix_name, n_stars);
+
+	vector<size_t> order(pix_name.size());
+	for(size_t i=0; i<order.size(); i++) { order[i] = i; }
+	std::sort(order.begin(), order.end(),
+		[&](size_t a, size_t b) {
+			if(n_stars[a] != n_stars[b]) { return n_stars[a] > n_stars[b]; }
+			return pix_name[a] < pix_name[b];
 		}
-		cout << "# " << stellar_data.star.size() << " stars in pixel" << endl;
+	);
 
+	vector<size_t> shard_stars(opts.N_shards, 0);
+	vector<bool> in_shard(pix_name.size(), false);
 
-		// Check if this pixel has already been fully processed
-		if(!(opts.clobber)) {
-			bool process_pixel = false;
+	for(vector<size_t>::const_iterator it = order.begin(); it != order.end(); ++it) {
+		size_t s_min = std::min_element(shard_stars.begin(), shard_stars.end())
+		               - shard_stars.begin();
+		shard_stars[s_min] += n_stars[*it];
+		if(s_min == opts.shard_index) { in_shard[*it] = true; }
+	}
 
-			H5::H5File *out_file = H5Utils::openFile(
-				opts.output_fname,
-				H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
-			);
+	size_t n_stars_shard = 0;
+	for(size_t i=0; i<pix_name.size(); i++) {
+		if(in_shard[i]) {
+			pix_shard.push_back(pix_name[i]);
+			n_stars_shard += n_stars[i];
+		}
+	}
 
-			if(out_file == NULL) {
-				process_pixel = true;
+	cout << "# Shard " << opts.shard_index << "/" << opts.N_shards << ": "
+	     << pix_shard.size() << " pixels, " << n_stars_shard << " stars."
+	     << endl << endl;
+}
 
-				//cout << "File does not exist" << endl;
-			} else {
-				//cout << "File exists" << endl;
-				//stringstream group_name;
-				//group_name << stellar_data.healpix_index;
-				//group_name << stellar_data.nside << "-" << stellar_data.healpix_index;
-
-				H5::Group *pix_group = H5Utils::openGroup(
-					out_file,
-					*it,
-					H5Utils::READ | H5Utils::WRITE | H5Utils::DONOTCREATE
-				);
 
-				if(pix_group == NULL) {
-					process_pixel = true;
-				} else {
-					//cout << "Group exists" << endl;
-
-					if(!H5Utils::dataset_exists("stellar chains", pix_group)) {
-						process_pixel = true;
-					} else {
-						if(opts.save_surfs) {
-							if(!H5Utils::dataset_exists("stellar pdfs", pix_group)) {
-								process_pixel = true;
-							}
-						}
-
-						if((!process_pixel) && (opts.N_clouds != 0)) {
-							if(!H5Utils::dataset_exists("clouds", pix_group)) {
-								process_pixel = true;
-							}
-						}
-
-						if((!process_pixel) && (opts.N_regions != 0)) {
-							if(!H5Utils::dataset_exists("los", pix_group)) {
-								process_pixel = true;
-							}
-						}
-					}
-
-					delete pix_group;
-
-					// If pixel is missing data, remove it, so that it can be regenerated
-					if(process_pixel) {
-						try {
-							out_file->unlink(*it);
-						} catch(H5::FileIException unlink_err) {
-							cout << "Unable to remove group: '" << *it << "'"
-								 << endl;
-						}
-					}
-				}
-
-				delete out_file;
-			}
+/*
+ *  Run the full analysis (individual stars + line-of-sight fits)
+ *  on one pixel, using up to <n_threads> threads. Output is handed
+ *  off to <write_queue>, so that it can be written to disk while
+ *  the next pixel is being processed. Returns the time taken (in s).
+ */
+double process_pixel(TProgramOpts &opts, TPixelModels &models,
+                   TStellarData &stellar_data, TWriteQueue *write_queue,
+                   const string &pix_name, unsigned int pixel_list_no,
+                   unsigned int n_pixels, unsigned int n_threads) {
+	timespec t_start, t_mid, t_end;
+	double t_tot, t_star;
 
-			if(!process_pixel) {
-				cout << "# Pixel is already present in output. Skipping."
-					 << endl << endl;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
 
-				continue; // All information is already present in output file
-			}
-		}
+	// Each pixel gets its own copy of the MCMC options
+	TMCMCOptions star_options(opts.star_steps, opts.star_samplers, opts.star_p_replacement, opts.N_runs,
+	                          opts.parallel_stars);
+	TMCMCOptions cloud_options(opts.cloud_steps, opts.cloud_samplers, opts.cloud_p_replacement, opts.N_runs);
+	TMCMCOptions los_options(opts.los_steps, opts.los_samplers, opts.los_p_replacement, opts.N_runs);
 
-		// Prepare data structures for stellar parameters
-		unsigned int n_stars = stellar_data.star.size();
-		TImgStack img_stack(n_stars);
-		vector<bool> conv;
-		vector<double> lnZ;
-		vector<double> chi2;
-
-		bool gatherSurfs = (opts.N_regions || opts.N_clouds || opts.save_surfs);
-
-		// Sample individual stars
-		if(!opts.sample_stars) {
-			// Grid evaluation of stellar models
-			grid_eval_stars(los_model, ext_model, *emplib,
-							stellar_data, EBV_smoothing,
-							img_stack, chi2,
-							opts.save_surfs, opts.output_fname,
-							opts.star_priors,
-					                opts.use_gaia,
-							opts.mean_RV, opts.verbosity);
-		} else if(opts.synthetic) {
-			// MCMC sampling of synthetic stellar model
-			sample_indiv_synth(opts.output_fname, star_options, los_model, *synthlib, ext_model,
-			                   stellar_data, img_stack, conv, lnZ, opts.sigma_RV,
-			                   opts.min_EBV, opts.save_surfs, gatherSurfs, opts.verbosity);
-		} else {
-			#ifdef _USE_PARALLEL_TEMPERING__
-			// MCMC sampling of empirical stellar model
-			sample_indiv_emp_pt(opts.output_fname, star_options, los_model,
-								*emplib, ext_model, EBV_smoothing,
-			                    stellar_data, img_stack, conv, lnZ,
-								opts.mean_RV, opts.sigma_RV, opts.min_EBV,
-			                    opts.save_surfs, gatherSurfs, opts.star_priors,
-								opts.verbosity);
-			#else // _USE_PARALLEL_TEMPERING
-			// MCMC sampling of empirical stellar model
-			sample_indiv_emp(opts.output_fname, star_options, los_model,
-							 *emplib, ext_model, EBV_smoothing,
-			                 stellar_data, img_stack, conv, lnZ,
-							 opts.mean_RV, opts.sigma_RV, opts.min_EBV,
-			                 opts.save_surfs, gatherSurfs, opts.star_priors,
-							 opts.verbosity);
-			#endif // _USE_PARALLEL_TERMPERING
-		}
+	TMCMCOptions discrete_los_options(opts.discrete_steps, 1, 0., opts.N_runs);    // TODO: Create commandline options for this
 
-		clock_gettime(CLOCK_MONOTONIC, &t_mid);
+	TGalacticLOSModel los_model(
+		stellar_data.l,
+		stellar_data.b,
+		opts.gal_struct_params
+	);
+
+	// Pixel headers are written in one block, so that they are not
+	// interleaved with the output of other pixels.
+	stringstream pix_header;
+	pix_header << "# Pixel: " << pix_name
+		<< " (" << pixel_list_no + 1 << " of " << n_pixels << ")"
+		<< endl;
+	pix_header << "# HEALPix index: " << stellar_data.healpix_index
+		 << " (nside = " << stellar_data.nside << ")" << endl;
+	pix_header << "# (l, b) = "
+		 << stellar_data.l << ", " << stellar_data.b << endl;
+	if(opts.SFD_prior) {
+		pix_header << "# E(B-V)_SFD = " << stellar_data.EBV << endl;
+	}
+	pix_header << "# " << stellar_data.star.size() << " stars in pixel" << endl;
+
+	#pragma omp critical (cout)
+	cout << pix_header.str() << flush;
+
+	// Prepare data structures for stellar parameters
+	unsigned int n_stars = stellar_data.star.size();
+	TImgStack img_stack(n_stars);
+	vector<bool> conv;
+	vector<double> lnZ;
+	vector<double> chi2;
+
+	bool gatherSurfs = (opts.N_regions || opts.N_clouds || opts.save_surfs);
+
+	// Sample individual stars
+	if(!opts.sample_stars) {
+		// Grid evaluation of stellar models
+		grid_eval_stars(los_model, *(models.ext_model), *(models.emplib),
+						stellar_data, *(models.EBV_smoothing),
+						img_stack, chi2,
+						opts.save_surfs, opts.output_fname,
+						opts.star_priors,
+				                opts.use_gaia,
+						opts.mean_RV, opts.verbosity,
+						write_queue);
+	} else if(opts.synthetic) {
+		// MCMC sampling of synthetic stellar model
+		sample_indiv_synth(opts.output_fname, star_options, los_model, *(models.synthlib), *(models.ext_model),
+		                   stellar_data, img_stack, conv, lnZ, opts.sigma_RV,
+		                   opts.min_EBV, opts.save_surfs, gatherSurfs, opts.verbosity,
+		                   write_queue);
+	} else {
+		#ifdef _USE_PARALLEL_TEMPERING__
+		// MCMC sampling of empirical stellar model
+		sample_indiv_emp_pt(opts.output_fname, star_options, los_model,
+							*(models.emplib), *(models.ext_model), *(models.EBV_smoothing),
+		                    stellar_data, img_stack, conv, lnZ,
+							opts.mean_RV, opts.sigma_RV, opts.min_EBV,
+		                    opts.save_surfs, gatherSurfs, opts.star_priors,
+							opts.verbosity);
+		#else // _USE_PARALLEL_TEMPERING
+		// MCMC sampling of empirical stellar model
+		sample_indiv_emp(opts.output_fname, star_options, los_model,
+						 *(models.emplib), *(models.ext_model), *(models.EBV_smoothing),
+		                 stellar_data, img_stack, conv, lnZ,
+						 opts.mean_RV, opts.sigma_RV, opts.min_EBV,
+		                 opts.save_surfs, gatherSurfs, opts.star_priors,
+						 opts.verbosity, write_queue);
+		#endif // _USE_PARALLEL_TERMPERING
+	}
 
-		// Tag output pixel with HEALPix nside and index
-		stringstream group_name;
-		group_name << "/" << *it;
+	clock_gettime(CLOCK_MONOTONIC, &t_mid);
 
-		try {
-			H5Utils::add_watermark<uint32_t>(opts.output_fname, group_name.str(), "nside", stellar_data.nside);
-			H5Utils::add_watermark<uint64_t>(opts.output_fname, group_name.str(), "healpix_index", stellar_data.healpix_index);
-		} catch(H5::AttributeIException err_att_exists) { }
+	// Tag output pixel with HEALPix nside and index
+	stringstream group_name;
+	group_name << "/" << pix_name;
 
-		// Filter based on goodness-of-fit and convergence
-		vector<bool> keep;
-		bool filter_tmp;
-		size_t n_filtered = 0;
+	queue_watermark<uint32_t>(write_queue, opts.output_fname, group_name.str(), "nside", stellar_data.nside);
+	queue_watermark<uint64_t>(write_queue, opts.output_fname, group_name.str(), "healpix_index", stellar_data.healpix_index);
 
-		std::vector<double> subpixel;
-		vector<double> lnZ_filtered;
+	// Filter based on goodness-of-fit and convergence
+	vector<bool> keep;
+	bool filter_tmp;
+	size_t n_filtered = 0;
 
-		if(opts.sample_stars) {
-			// For sampled stars, use convergence and lnZ
-			assert(conv.size() == lnZ.size());
-			for(vector<double>::iterator it_lnZ = lnZ.begin(); it_lnZ != lnZ.end(); ++it_lnZ) {
-				if(!std::isnan(*it_lnZ) && !is_inf_replacement(*it_lnZ)) {
-					lnZ_filtered.push_back(*it_lnZ);
-				}
-			}
-			double lnZmax = percentile_const(lnZ_filtered, 95.0);
-			if(opts.verbosity >= 2) {
-				cout << "# ln(Z)_95pct = " << lnZmax << endl;
+	std::vector<double> subpixel;
+	vector<double> lnZ_filtered;
+
+	if(opts.sample_stars) {
+		// For sampled stars, use convergence and lnZ
+		assert(conv.size() == lnZ.size());
+		for(vector<double>::iterator it_lnZ = lnZ.begin(); it_lnZ != lnZ.end(); ++it_lnZ) {
+			if(!std::isnan(*it_lnZ) && !is_inf_replacement(*it_lnZ)) {
+				lnZ_filtered.push_back(*it_lnZ);
 			}
+		}
+		double lnZmax = percentile_const(lnZ_filtered, 95.0);
+		if(opts.verbosity >= 2) {
+			#pragma omp critical (cout)
+			cout << "# ln(Z)_95pct = " << lnZmax << endl;
+		}
 
-			lnZ_filtered.clear();
-			for(size_t n=0; n<conv.size(); n++) {
-				filter_tmp = conv[n]
-							 && (lnZ[n] > lnZmax - (25. + opts.ev_cut))
-							 && !std::isnan(lnZ[n])
-							 && !is_inf_replacement(lnZ[n])
-							 && (stellar_data.star[n].EBV < opts.subpixel_max);
-				keep.push_back(filter_tmp);
-				if(filter_tmp) {
-					subpixel.push_back(stellar_data.star[n].EBV);
-					lnZ_filtered.push_back(lnZ[n] - lnZmax);
-				} else {
-					n_filtered++;
-				}
+		lnZ_filtered.clear();
+		for(size_t n=0; n<conv.size(); n++) {
+			filter_tmp = conv[n]
+						 && (lnZ[n] > lnZmax - (25. + opts.ev_cut))
+						 && !std::isnan(lnZ[n])
+						 && !is_inf_replacement(lnZ[n])
+						 && (stellar_data.star[n].EBV < opts.subpixel_max);
+			keep.push_back(filter_tmp);
+			if(filter_tmp) {
+				subpixel.push_back(stellar_data.star[n].EBV);
+				lnZ_filtered.push_back(lnZ[n] - lnZmax);
+			} else {
+				n_filtered++;
 			}
-		} else {
-			// For grid-evaluated stars, use chi^2 / passband
-			for(size_t n=0; n<chi2.size(); n++) {
-				filter_tmp = (chi2[n] < opts.chi2_cut)
-							 && !std::isnan(chi2[n])
-							 && !is_inf_replacement(chi2[n])
-							 && (stellar_data.star[n].EBV < opts.subpixel_max);
-				keep.push_back(filter_tmp);
-				if(filter_tmp) {
-					subpixel.push_back(stellar_data.star[n].EBV);
-					lnZ_filtered.push_back(0.);	// Dummy value
-				} else {
-					n_filtered++;
-				}
+		}
+	} else {
+		// For grid-evaluated stars, use chi^2 / passband
+		for(size_t n=0; n<chi2.size(); n++) {
+			filter_tmp = (chi2[n] < opts.chi2_cut)
+						 && !std::isnan(chi2[n])
+						 && !is_inf_replacement(chi2[n])
+						 && (stellar_data.star[n].EBV < opts.subpixel_max);
+			keep.push_back(filter_tmp);
+			if(filter_tmp) {
+				subpixel.push_back(stellar_data.star[n].EBV);
+				lnZ_filtered.push_back(0.);	// Dummy value
+			} else {
+				n_filtered++;
 			}
 		}
-		if(gatherSurfs) { img_stack.cull(keep); }
-
-		// Fit line-of-sight extinction profile
-		if(((opts.N_clouds != 0) || (opts.N_regions != 0) || opts.discrete_los)
-				&& (n_filtered < n_stars)) {
-			//
-			cout << "# of stars filtered: "
-				 << n_filtered << " of " << n_stars;
-			cout << " (" << 100. * (double)n_filtered / n_stars
-				 << " %)" << endl;
-
-			double p0 = exp(-5. - opts.ev_cut);
-			double EBV_max = -1.;
-			if(opts.SFD_prior) {
-				if(opts.SFD_subpixel) {
-					EBV_max = 1.;
-				} else {
-					EBV_max = stellar_data.EBV;
-				}
+	}
+	if(gatherSurfs) { img_stack.cull(keep); }
+
+	// Fit line-of-sight extinction profile
+	if(((opts.N_clouds != 0) || (opts.N_regions != 0) || opts.discrete_los)
+			&& (n_filtered < n_stars)) {
+		//
+		#pragma omp critical (cout)
+		{
+		cout << "# " << pix_name << ": # of stars filtered: "
+			 << n_filtered << " of " << n_stars;
+		cout << " (" << 100. * (double)n_filtered / n_stars
+			 << " %)" << endl;
+		}
+
+		double p0 = exp(-5. - opts.ev_cut);
+		double EBV_max = -1.;
+		if(opts.SFD_prior) {
+			if(opts.SFD_subpixel) {
+				EBV_max = 1.;
+			} else {
+				EBV_max = stellar_data.EBV;
 			}
+		}
 
-			TLOSMCMCParams params(
-				&img_stack, lnZ_filtered, p0,
-				opts.N_runs, opts.N_threads,
-				opts.N_regions, EBV_max
-			);
-			if(opts.SFD_subpixel) { params.set_subpixel_mask(subpixel); }
+		TLOSMCMCParams params(
+			&img_stack, lnZ_filtered, p0,
+			opts.N_runs, n_threads,
+			opts.N_regions, EBV_max
+		);
+		if(opts.SFD_subpixel) { params.set_subpixel_mask(subpixel); }
 
-			if(opts.test_mode) {
-				test_extinction_profiles(params);
-			}
+		if(opts.test_mode) {
+			test_extinction_profiles(params);
+		}
+
+		if(opts.discrete_los) {
+			#pragma omp critical (cout)
+			cout << "Sampling line of sight discretely ..." << endl;
+            // Independent replicas are run in parallel, and checked
+            // against one another for convergence
+            TDiscreteLosMcmcParams discrete_los_params(&img_stack, opts.N_runs, n_threads);
+			discrete_los_params.initialize_priors(
+				los_model,
+				opts.log_Delta_EBV_floor,
+				opts.log_Delta_EBV_ceil,
+				opts.verbosity
+			);
+			discrete_los_params.n_temperatures = opts.discrete_temperatures;
+			discrete_los_params.beta_min = opts.discrete_beta_min;
+            sample_los_extinction_discrete(
+                opts.output_fname,
+                pix_name,
+                discrete_los_options,
+                discrete_los_params,
+                opts.verbosity,
+                write_queue
+            );
+			#pragma omp critical (cout)
+            cout << "Done with discrete sampling." << endl;
+		}
 
-			if(opts.discrete_los) {
-				cout << "Sampling line of sight discretely ..." << endl;
-	            TDiscreteLosMcmcParams discrete_los_params(&img_stack, 1, 1);
-				discrete_los_params.initialize_priors(
+		if(opts.N_clouds != 0) {
+			sample_los_extinction_clouds(
+				opts.output_fname, pix_name,
+				cloud_options, params,
+				opts.N_clouds, opts.verbosity,
+				write_queue
+			);
+		}
+		if(opts.N_regions != 0) {
+			// Covariance matrix for guess has (anti-)correlation
+			// length of 1 distance bin
+			params.gen_guess_covariance(1.);
+
+			if(opts.disk_prior) {
+				params.alpha_skew = 1.;
+				params.calc_Delta_EBV_prior(
 					los_model,
 					opts.log_Delta_EBV_floor,
-					opts.log_Delta_EBV_ceil,
+				    opts.log_Delta_EBV_ceil,
+				    stellar_data.EBV,
+					1.4,
 					opts.verbosity
 				);
-	            sample_los_extinction_discrete(
-	                opts.output_fname,
-	                *it,
-	                discrete_los_options,
-	                discrete_los_params,
-	                opts.verbosity
-	            );
-	            cout << "Done with discrete sampling." << endl;
 			}
 
-			if(opts.N_clouds != 0) {
-				sample_los_extinction_clouds(
-					opts.output_fname, *it,
-					cloud_options, params,
-					opts.N_clouds, opts.verbosity
-				);
-			}
-			if(opts.N_regions != 0) {
-				// Covariance matrix for guess has (anti-)correlation
-				// length of 1 distance bin
-				params.gen_guess_covariance(1.);
-
-				if(opts.disk_prior) {
-					params.alpha_skew = 1.;
-					params.calc_Delta_EBV_prior(
-						los_model,
-						opts.log_Delta_EBV_floor,
-					    opts.log_Delta_EBV_ceil,
-					    stellar_data.EBV,
-						1.4,
-						opts.verbosity
-					);
-				}
-
-				sample_los_extinction(
-					opts.output_fname, *it,
-					los_options, params, opts.verbosity
-				);
-			}
+			sample_los_extinction(
+				opts.output_fname, pix_name,
+				los_options, params, opts.verbosity,
+				write_queue
+			);
 		}
+	}
+
+	// Record the pixel as complete, once all of its output is on disk
+	queue_pixel_complete(write_queue, opts.output_fname, pix_name);
+
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	t_tot = (t_end.tv_sec - t_start.tv_sec)
+			+ 1.e-9 * (t_end.tv_nsec - t_start.tv_nsec);
+	t_star = (t_mid.tv_sec - t_start.tv_sec)
+			+ 1.e-9 * (t_mid.tv_nsec - t_start.tv_nsec);
+
+	stringstream pix_summary;
+	if(opts.verbosity >= 1) {
+		pix_summary << endl
+			 << "==================================================="
+			 << endl;
+	}
+	pix_summary << "# Time elapsed for pixel " << pix_name << ": "
+		 << setprecision(2) << t_tot
+		 << " s (" << setprecision(2)
+		 << t_tot / (double)(stellar_data.star.size())
+		 << " s / star)" << endl;
+	pix_summary << "# Percentage of time spent on l.o.s. fit: "
+		 << setprecision(2) << 100. * (t_tot - t_star) / t_tot
+		 << " %" << endl;
+	if(opts.verbosity >= 1) {
+		pix_summary << "==================================================="
+			 << endl;
+	}
+	pix_summary << endl;
+
+	#pragma omp critical (cout)
+	cout << pix_summary.str() << flush;
 
-		clock_gettime(CLOCK_MONOTONIC, &t_end);
-		t_tot = (t_end.tv_sec - t_start.tv_sec)
-				+ 1.e-9 * (t_end.tv_nsec - t_start.tv_nsec);
-		t_star = (t_mid.tv_sec - t_start.tv_sec)
-				+ 1.e-9 * (t_mid.tv_nsec - t_start.tv_nsec);
+	return t_tot;
+}
+
+
+/*
+ *  Format a duration (in s) as "D d H h M m".
+ */
+string format_duration(double t) {
+	long mm_tot = (long)ceil(t / 60.);
+	long dd = mm_tot / (60 * 24);
+	long hh = (mm_tot / 60) % 24;
+	long mm = mm_tot % 60;
+
+	stringstream ss;
+	if(dd != 0) { ss << dd << " d "; }
+	if((dd != 0) || (hh != 0)) { ss << hh << " h "; }
+	ss << mm << " m";
+	return ss.str();
+}
+
+
+int main(int argc, char **argv) {
+	gsl_set_error_handler_off();
+
+	/*
+	 *  Parse commandline arguments
+	 */
+
+	TProgramOpts opts;
+	int parse_res = get_program_opts(argc, argv, opts);
+	if(parse_res <= 0) { return parse_res; }
+
+	time_t tmp_time = time(0);
+	char * dt = ctime(&tmp_time);
+	cout << "# Start time: " << dt;
+
+	timespec prog_start_time;
+	clock_gettime(CLOCK_MONOTONIC, &prog_start_time);
 
-		if(opts.verbosity >= 1) {
-			cout << endl
-				 << "==================================================="
-				 << endl;
+
+	/*
+	 *  Construct models
+	 */
+
+	TStellarModel *emplib = NULL;
+	TSyntheticStellarModel *synthlib = NULL;
+	if(opts.synthetic) {
+		synthlib = new TSyntheticStellarModel(DATADIR "PS1templates.h5");
+	} else {
+		emplib = new TStellarModel(opts.LF_fname, opts.template_fname);
+	}
+	TExtinctionModel ext_model(opts.ext_model_fname);
+
+	TEBVSmoothing EBV_smoothing(opts.smoothing_alpha_coeff,
+	                            opts.smoothing_beta_coeff,
+	                            opts.pct_smoothing_min,
+	                            opts.pct_smoothing_max);
+
+	TPixelModels models;
+	models.emplib = emplib;
+	models.synthlib = synthlib;
+	models.ext_model = &ext_model;
+	models.EBV_smoothing = &EBV_smoothing;
+
+	/*
+	 *  Execute
+	 */
+
+	// Get list of pixels in input file
+	vector<string> pix_name_all;
+	get_input_pixels(opts.input_fname, pix_name_all);
+	cout << "# " << pix_name_all.size() << " pixels in input file." << endl << endl;
+
+	H5::Exception::dontPrint();
+
+	// Restrict to this run's shard of the input
+	if(opts.N_shards > 1) {
+		vector<string> pix_shard;
+		select_shard_pixels(opts, pix_name_all, pix_shard);
+		pix_name_all.swap(pix_shard);
+	}
+
+	if(opts.clobber) { remove(opts.output_fname.c_str()); }
+
+	// Keep the output file open for the whole run. All output, including
+	// the watermarks below, is written through this one handle.
+	H5Utils::TFileSession output_session(opts.output_fname);
+	if(!output_session.is_open()) {
+		cerr << "Could not open " << opts.output_fname << " for writing." << endl;
+		return -1;
+	}
+
+	// Determine which pixels are already done
+	vector<string> pix_name;
+	if(opts.clobber) {
+		pix_name = pix_name_all;
+
+		H5::H5File *out_file = H5Utils::openFile(opts.output_fname);
+		create_pixel_manifest(out_file, pixel_datasets_key(opts));
+		delete out_file;
+	} else {
+		select_incomplete_pixels(opts, pix_name_all, pix_name);
+
+		size_t n_done = pix_name_all.size() - pix_name.size();
+		if(n_done != 0) {
+			cout << "# " << n_done << " pixels already present in output. "
+				 << "Skipping." << endl << endl;
 		}
-		cout << "# Time elapsed for pixel: "
-			 << setprecision(2) << t_tot
-			 << " s (" << setprecision(2)
-			 << t_tot / (double)(stellar_data.star.size())
-			 << " s / star)" << endl;
-		cout << "# Percentage of time spent on l.o.s. fit: "
-			 << setprecision(2) << 100. * (t_tot - t_star) / t_tot
-			 << " %" << endl;
-		if(opts.verbosity >= 1) {
-			cout << "==================================================="
-				 << endl;
+	}
+
+	// Order pixels, and prepare to predict their run times
+	vector<size_t> pix_n_stars;
+	get_input_pixel_sizes(opts.input_fname, pix_name, pix_n_stars);
+	if(opts.pixel_order == "largest-first") {
+		order_pixels_largest_first(pix_name, pix_n_stars);
+	}
+	TPixelCostModel cost_model(pix_n_stars);
+
+	// Divide threads between concurrently running pixels, with each
+	// pixel getting an equal budget of threads for its own samplers:
+	//     (# of pixels) x (threads / pixel) <= N_threads
+	unsigned int n_pixel_threads = opts.N_pixel_threads;
+	if(n_pixel_threads > opts.N_threads) { n_pixel_threads = opts.N_threads; }
+	if(n_pixel_threads > pix_name.size()) { n_pixel_threads = pix_name.size(); }
+	if(n_pixel_threads < 1) { n_pixel_threads = 1; }
+	unsigned int n_inner_threads = opts.N_threads / n_pixel_threads;
+
+	if(n_pixel_threads > 1) {
+		cout << "# Processing " << n_pixel_threads << " pixels at a time, "
+			 << "with " << n_inner_threads << " thread(s) per pixel." << endl << endl;
+	}
+
+	omp_set_max_active_levels(2);
+	omp_set_num_threads(n_inner_threads);
+
+	// Pipeline: photometry is read ahead of the pixels being processed,
+	// and output is written on a background thread.
+	TPixelPrefetcher prefetcher(opts.input_fname, pix_name, opts.err_floor,
+	                            2 * n_pixel_threads);
+	TWriteQueue write_queue(16 * n_pixel_threads);
+
+	// Run each pixel. Pixels are handed out in order, as threads
+	// become free. Each pixel writes to its own group in the output
+	// file, so the file contents do not depend on completion order.
+	#pragma omp parallel for schedule(dynamic) num_threads(n_pixel_threads)
+	for(size_t pixel_list_no=0; pixel_list_no<pix_name.size(); pixel_list_no++) {
+		omp_set_num_threads(n_inner_threads);
+
+		std::unique_ptr<TStellarData> stellar_data = prefetcher.get(pixel_list_no);
+
+		double t_pix = process_pixel(
+			opts, models, *stellar_data, &write_queue,
+			pix_name[pixel_list_no], pixel_list_no,
+			pix_name.size(), n_inner_threads
+		);
+
+		cost_model.add_measurement(pixel_list_no, t_pix);
+		size_t n_remaining = cost_model.n_remaining();
+		if(n_remaining != 0) {
+			double t_remaining = cost_model.predict_remaining(n_pixel_threads);
+			#pragma omp critical (cout)
+			cout << "# Predicted time remaining: " << format_duration(t_remaining)
+				 << " (" << n_remaining << " pixels)" << endl << endl;
 		}
-		cout << endl;
 	}
 
+	write_queue.flush();
+
 
 	/*
 	 *  Add additional metadata to output file
@@ -0,0 +1,149 @@
+/*
+ * manifest.cpp
+ *
+ * Index of the pixels whose output is complete, stored in the output
+ * file itself. Reading the index once at startup replaces probing
+ * each pixel's group for the expected datasets.
+ *
+ * This file is part of bayestar.
+ * Copyright 2012 Gregory Green
+ *
+ * Bayestar is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include "manifest.h"
+
+
+const char *PIXEL_MANIFEST_DSET = "/completed pixels";
+const char *PIXEL_MANIFEST_DATASETS_ATTR = "datasets";
+
+
+// Create an empty manifest. Extendable, so that one entry can be
+// appended at a time.
+static H5::DataSet create_manifest_dataset(H5::H5File *file) {
+	H5::StrType strtype(0, H5T_VARIABLE);
+	hsize_t dim = 0;
+	hsize_t max_dim = H5S_UNLIMITED;
+	hsize_t chunk = 256;
+	H5::DataSpace dspace(1, &dim, &max_dim);
+	H5::DSetCreatPropList plist;
+	plist.setChunk(1, &chunk);
+
+	return file->createDataSet(PIXEL_MANIFEST_DSET, strtype, dspace, plist);
+}
+
+
+bool read_pixel_manifest(H5::H5File *file, std::set<std::string> &completed) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
+	if(!H5Utils::dataset_exists(PIXEL_MANIFEST_DSET, file)) { return false; }
+
+	H5::DataSet dataset = file->openDataSet(PIXEL_MANIFEST_DSET);
+	H5::DataSpace dspace = dataset.getSpace();
+	hsize_t length;
+	dspace.getSimpleExtentDims(&length);
+	if(length == 0) { return true; }
+
+	H5::StrType strtype(0, H5T_VARIABLE);
+	std::vector<char*> buf(length);
+	dataset.read(buf.data(), strtype);
+
+	for(hsize_t i=0; i<length; i++) {
+		completed.insert(std::string(buf[i]));
+	}
+
+	H5::DataSet::vlenReclaim(buf.data(), strtype, dspace);
+
+	return true;
+}
+
+
+bool read_pixel_manifest_datasets(H5::H5File *file, std::string &datasets) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
+	if(!H5Utils::dataset_exists(PIXEL_MANIFEST_DSET, file)) { return false; }
+
+	H5::DataSet dataset = file->openDataSet(PIXEL_MANIFEST_DSET);
+	if(H5Aexists(dataset.getId(), PIXEL_MANIFEST_DATASETS_ATTR) <= 0) { return false; }
+
+	H5::Attribute att = dataset.openAttribute(PIXEL_MANIFEST_DATASETS_ATTR);
+	H5::StrType strtype(0, H5T_VARIABLE);
+	att.read(strtype, datasets);
+
+	return true;
+}
+
+
+void create_pixel_manifest(H5::H5File *file, const std::string &datasets) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
+	if(H5Utils::dataset_exists(PIXEL_MANIFEST_DSET, file)) {
+		file->unlink(PIXEL_MANIFEST_DSET);
+	}
+
+	H5::DataSet dataset = create_manifest_dataset(file);
+
+	H5::StrType strtype(0, H5T_VARIABLE);
+	H5::DataSpace att_space(H5S_SCALAR);
+	H5::Attribute att = dataset.createAttribute(PIXEL_MANIFEST_DATASETS_ATTR, strtype, att_space);
+	att.write(strtype, datasets);
+}
+
+
+void append_pixel_manifest(H5::H5File *file, const std::string &pix_name) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
+	H5::StrType strtype(0, H5T_VARIABLE);
+	H5::DataSet dataset;
+	hsize_t length = 0;
+
+	if(!H5Utils::dataset_exists(PIXEL_MANIFEST_DSET, file)) {
+		dataset = create_manifest_dataset(file);
+	} else {
+		dataset = file->openDataSet(PIXEL_MANIFEST_DSET);
+		dataset.getSpace().getSimpleExtentDims(&length);
+	}
+
+	hsize_t new_length = length + 1;
+	dataset.extend(&new_length);
+
+	H5::DataSpace file_space = dataset.getSpace();
+	hsize_t count = 1;
+	file_space.selectHyperslab(H5S_SELECT_SET, &count, &length);
+	H5::DataSpace mem_space(1, &count);
+
+	const char *name = pix_name.c_str();
+	dataset.write(&name, strtype, mem_space, file_space);
+}
+
+
+void append_pixel_manifest(const std::string &fname, const std::string &pix_name) {
+	std::lock_guard<std::recursive_mutex> h5_lock(H5Utils::io_mutex);
+
+	H5::H5File *file = H5Utils::openFile(fname);
+	if(file == NULL) {
+		std::cerr << "! Could not open " << fname
+		          << " to mark pixel '" << pix_name << "' as complete."
+		          << std::endl;
+		return;
+	}
+
+	append_pixel_manifest(file, pix_name);
+
+	delete file;
+}
+
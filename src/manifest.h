@@ -0,0 +1,68 @@
+/*
+ * manifest.h
+ *
+ * Index of the pixels whose output is complete, stored in the output
+ * file itself. Reading the index once at startup replaces probing
+ * each pixel's group for the expected datasets.
+ *
+ * This file is part of bayestar.
+ * Copyright 2012 Gregory Green
+ *
+ * Bayestar is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _MANIFEST_H__
+#define _MANIFEST_H__
+
+#include <string>
+#include <set>
+#include <vector>
+
+#include <H5Cpp.h>
+
+#include "h5utils.h"
+
+
+// Name of the (1-D, variable-length string) dataset holding the
+// names of all completed pixels
+extern const char *PIXEL_MANIFEST_DSET;
+
+// Name of the (string) attribute of the manifest that lists the
+// datasets each completed pixel holds. Which datasets are written
+// depends on the run options, so a manifest is only valid for runs
+// that expect the same datasets.
+extern const char *PIXEL_MANIFEST_DATASETS_ATTR;
+
+// Read the names of all completed pixels. Returns false if the file
+// does not contain a manifest (e.g., older output files).
+bool read_pixel_manifest(H5::H5File *file, std::set<std::string> &completed);
+
+// Read the list of datasets recorded with the manifest. Returns false
+// if there is no manifest, or if it does not record the datasets
+// (e.g., manifests from older versions, or merged from such files).
+bool read_pixel_manifest_datasets(H5::H5File *file, std::string &datasets);
+
+// Start a new, empty manifest, for pixels holding <datasets>. Any
+// existing manifest is replaced.
+void create_pixel_manifest(H5::H5File *file, const std::string &datasets);
+
+// Record that the output for pixel <pix_name> is complete
+void append_pixel_manifest(H5::H5File *file, const std::string &pix_name);
+void append_pixel_manifest(const std::string &fname, const std::string &pix_name);
+
+
+#endif // _MANIFEST_H__
@@ -0,0 +1,225 @@
+/*
+ * merge.cpp
+ *
+ * Merges the output files of several bayestar runs (e.g., the shards
+ * of one input file, see --shard) into a single output file.
+ *
+ * Usage: bayestar_merge [output] [input 1] [input 2] ...
+ *
+ * Only pixels that are complete (according to each file's manifest)
+ * are copied. All inputs must hold the same datasets (see
+ * PIXEL_MANIFEST_DATASETS_ATTR in manifest.h), which are recorded with
+ * the merged manifest, so that runs can be resumed from the output. Pixel groups are copied with H5Ocopy, which moves the
+ * compressed chunks across without decoding and re-encoding them.
+ *
+ * This file is part of bayestar.
+ * Copyright 2012 Gregory Green
+ *
+ * Bayestar is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+
+#include <H5Cpp.h>
+
+#include "h5utils.h"
+#include "manifest.h"
+
+using namespace std;
+
+
+/*
+ *  List the pixels to copy from an input file. If the file has no
+ *  manifest, every group in the root of the file is assumed to be a
+ *  complete pixel.
+ */
+void list_input_pixels(H5::H5File *file, const string &fname,
+                       vector<string> &pix_name) {
+	pix_name.clear();
+
+	set<string> completed;
+	if(read_pixel_manifest(file, completed)) {
+		pix_name.assign(completed.begin(), completed.end());
+		return;
+	}
+
+	cerr << "# Warning: " << fname << " has no manifest of completed pixels. "
+	     << "Copying all pixels." << endl;
+
+	H5::Group root = file->openGroup("/");
+	hsize_t n_objs = root.getNumObjs();
+	for(hsize_t i=0; i<n_objs; i++) {
+		if(root.getObjTypeByIdx(i) == H5G_GROUP) {
+			pix_name.push_back(root.getObjnameByIdx(i));
+		}
+	}
+}
+
+
+/*
+ *  The datasets recorded with a file's manifest, or an empty string if
+ *  they are unknown.
+ */
+string manifest_datasets(H5::H5File *file) {
+	string datasets;
+	if(!read_pixel_manifest_datasets(file, datasets)) { datasets.clear(); }
+	return datasets;
+}
+
+
+/*
+ *  Copy the attributes attached to the root of <src> (e.g., the version
+ *  and configuration watermarks) to <dest>, unless <dest> already has
+ *  an attribute of the same name.
+ */
+void copy_root_attributes(H5::H5File *src, H5::H5File *dest) {
+	H5::Group src_root = src->openGroup("/");
+	H5::Group dest_root = dest->openGroup("/");
+
+	int n_attrs = src_root.getNumAttrs();
+	for(int i=0; i<n_attrs; i++) {
+		H5::Attribute src_att = src_root.openAttribute((unsigned int)i);
+		string name = src_att.getName();
+
+		if(H5Aexists(dest_root.getId(), name.c_str()) > 0) { continue; }
+
+		H5::DataType dtype = src_att.getDataType();
+		H5::DataSpace dspace = src_att.getSpace();
+		vector<char> buf(src_att.getInMemDataSize());
+		src_att.read(dtype, buf.data());
+
+		H5::Attribute dest_att = dest_root.createAttribute(name, dtype, dspace);
+		dest_att.write(dtype, buf.data());
+
+		if(H5Tis_variable_str(dtype.getId()) > 0 || dtype.getClass() == H5T_VLEN) {
+			H5::DataSet::vlenReclaim(buf.data(), dtype, dspace);
+		}
+	}
+}
+
+
+int main(int argc, char **argv) {
+	if(argc < 3) {
+		cerr << "Usage: " << argv[0] << " [output] [input 1] [input 2] ..." << endl;
+		return -1;
+	}
+
+	string out_fname = argv[1];
+
+	H5::Exception::dontPrint();
+
+	H5::H5File *out_file = H5Utils::openFile(out_fname);
+	if(out_file == NULL) {
+		cerr << "Could not open " << out_fname << " for writing." << endl;
+		return -1;
+	}
+
+	set<string> merged;
+	read_pixel_manifest(out_file, merged);
+
+	// Datasets held by the merged pixels. An output that does not hold
+	// any pixels yet takes them from the first input.
+	string out_datasets = manifest_datasets(out_file);
+	bool out_datasets_set = !out_datasets.empty() || !merged.empty();
+
+	// Create any parent groups of the copied pixels as needed
+	hid_t lcpl = H5Pcreate(H5P_LINK_CREATE);
+	H5Pset_create_intermediate_group(lcpl, 1);
+
+	size_t n_copied = 0;
+	size_t n_skipped = 0;
+	int n_failed_files = 0;
+
+	for(int k=2; k<argc; k++) {
+		string in_fname = argv[k];
+
+		H5::H5File *in_file = H5Utils::openFile(in_fname, H5Utils::READ);
+		if(in_file == NULL) {
+			cerr << "# Could not open " << in_fname << ". Skipping." << endl;
+			n_failed_files++;
+			continue;
+		}
+
+		string in_datasets = manifest_datasets(in_file);
+		if(!out_datasets_set) {
+			if(!in_datasets.empty()) { create_pixel_manifest(out_file, in_datasets); }
+			out_datasets = in_datasets;
+			out_datasets_set = true;
+		} else if(in_datasets != out_datasets) {
+			cerr << "# " << in_fname << " holds different datasets ("
+			     << (in_datasets.empty() ? "unknown" : in_datasets)
+			     << ") than the output ("
+			     << (out_datasets.empty() ? "unknown" : out_datasets)
+			     << "). Skipping." << endl;
+			n_failed_files++;
+			delete in_file;
+			continue;
+		}
+
+		vector<string> pix_name;
+		list_input_pixels(in_file, in_fname, pix_name);
+
+		size_t n_copied_file = 0;
+		for(vector<string>::iterator it = pix_name.begin(); it != pix_name.end(); ++it) {
+			if(merged.count(*it) || H5Utils::group_exists(*it, out_file)) {
+				cerr << "# Warning: pixel '" << *it << "' from " << in_fname
+				     << " is already present in the output. Skipping." << endl;
+				n_skipped++;
+				continue;
+			}
+
+			herr_t status = H5Ocopy(in_file->getId(), it->c_str(),
+			                        out_file->getId(), it->c_str(),
+			                        H5P_DEFAULT, lcpl);
+			if(status < 0) {
+				cerr << "# Could not copy pixel '" << *it << "' from "
+				     << in_fname << "." << endl;
+				n_skipped++;
+				continue;
+			}
+
+			append_pixel_manifest(out_file, *it);
+			merged.insert(*it);
+			n_copied_file++;
+		}
+
+		try {
+			copy_root_attributes(in_file, out_file);
+		} catch(H5::Exception err) {
+			cerr << "# Could not copy attributes from " << in_fname << "." << endl;
+		}
+
+		cout << "# " << in_fname << ": copied " << n_copied_file << " of "
+		     << pix_name.size() << " pixels." << endl;
+		n_copied += n_copied_file;
+
+		delete in_file;
+	}
+
+	H5Pclose(lcpl);
+	delete out_file;
+
+	cout << endl << "# Merged " << n_copied << " pixels into " << out_fname;
+	if(n_skipped != 0) { cout << " (" << n_skipped << " skipped)"; }
+	cout << "." << endl;
+
+	return (n_failed_files == 0) ? 0 : -1;
+}
@@ -286,6 +286,11 @@ void TGalacticLOSModel::init(double _l, double _b) {
 	cos_b = cos(0.0174532925*b);
 	sin_b = sin(0.0174532925*b);
 
+	// No prior table until init_log_prior_emp_table is called
+	N_DM_table = 0;
+	DM_table_min = 0.;
+	inv_dDM_table = 0.;
+
 	// Precompute interpolation anchors for log(dN/dDM), f_halo and mu_FeH_disk
 	DM_min = 0.;
 	DM_max = 25.;
@@ -310,6 +315,65 @@ void TGalacticLOSModel::init(double _l, double _b) {
 	log_dNdmu_norm += log((log_dNdmu_arr->get_x(DM_samples-1) - log_dNdmu_arr->get_x(0)) / DM_samples);
 }
 
+void TGalacticLOSModel::init_log_prior_emp_table(const std::vector<double>& FeH) {
+	// Same DM range as the other l.o.s. interpolators, with spacing 0.01 mag
+	DM_table_min = DM_min;
+	N_DM_table = (unsigned int)((DM_max - DM_min) / 0.01) + 1;
+	double dDM = (DM_max - DM_min) / (double)(N_DM_table - 1);
+	inv_dDM_table = 1. / dDM;
+
+	FeH_table = FeH;
+	log_prior_table.resize(FeH.size() * N_DM_table);
+
+	for(unsigned int k=0; k<N_DM_table; k++) {
+		double DM = DM_table_min + k * dDM;
+		double f_H = f_halo(DM);
+		double log_dNdmu_tmp = log_dNdmu(DM);
+
+		for(unsigned int j=0; j<FeH.size(); j++) {
+			double p = (1. - f_H) * p_FeH_fast(DM, FeH[j], 0);
+			p += f_H * p_FeH_fast(DM, FeH[j], 1);
+			log_prior_table[j*N_DM_table + k] = log_dNdmu_tmp + log(p);
+		}
+	}
+}
+
+bool TGalacticLOSModel::has_log_prior_emp_table() const {
+	return log_prior_table.size() != 0;
+}
+
+void TGalacticLOSModel::log_prior_emp_table(const double* DM, const unsigned int* FeH_idx,
+                                            unsigned int n, double* log_prior) const {
+	assert(log_prior_table.size() != 0);
+
+	const double *table = log_prior_table.data();
+	const unsigned int N_DM = N_DM_table;
+	const double x_max = (double)(N_DM - 1);
+
+	// Interpolate, with indices clamped to the table, so that every
+	// lookup is in bounds and the loop can be vectorized. NaN fails both
+	// comparisons below, and is clamped to 0 before the cast ...
+	#pragma omp simd
+	for(unsigned int i=0; i<n; i++) {
+		double x = (DM[i] - DM_table_min) * inv_dDM_table;
+		x = (x >= 0.) ? x : 0.;
+		x = (x <= x_max) ? x : x_max;
+		unsigned int k = (unsigned int)x;
+		k = (k > N_DM - 2) ? N_DM - 2 : k;
+		double a = x - (double)k;
+		const double *row = table + FeH_idx[i] * N_DM;
+		log_prior[i] = (1. - a) * row[k] + a * row[k+1];
+	}
+
+	// ... then calculate the (rare) values outside of the table directly
+	double DM_table_max = DM_table_min + x_max / inv_dDM_table;
+	for(unsigned int i=0; i<n; i++) {
+		if((DM[i] < DM_table_min) || (DM[i] > DM_table_max) || std::isnan(DM[i])) {
+			log_prior[i] = log_prior_emp(DM[i], 0., FeH_table[FeH_idx[i]]);
+		}
+	}
+}
+
 void TGalacticLOSModel::DM_to_RZ(double DM, double& R, double& Z) const {
 	double d = pow10(DM/5. + 1.);
 	double X = R0 - cos_l*cos_b*d;
@@ -993,7 +1057,6 @@ TExtinctionModel::TExtinctionModel(std::string A_RV_fname) {
 	}
 
 	A_spl = new gsl_spline*[NBANDS];
-	acc = new gsl_interp_accel*[NBANDS];
 
 	unsigned int N = RV.size();
 	double Acoeff_i[N];
@@ -1002,26 +1065,60 @@ TExtinctionModel::TExtinctionModel(std::string A_RV_fname) {
 	for(unsigned int i=0; i<NBANDS; i++) {
 		for(unsigned int k=0; k<N; k++) { Acoeff_i[k] = Acoeff[NBANDS*k + i]; }
 		A_spl[i] = gsl_spline_alloc(gsl_interp_cspline, N);
-		acc[i] = gsl_interp_accel_alloc();
 		gsl_spline_init(A_spl[i], RV_arr, Acoeff_i, N);
 	}
+
+	// Tabulate the splines. Linear interpolation on this grid differs
+	// from the splines by ~ dRV^2 A'' / 8, which is negligible.
+	dRV_table = 1.e-3;
+	N_RV_table = (unsigned int)ceil((RV_max - RV_min) / dRV_table) + 1;
+	if(N_RV_table < 2) { N_RV_table = 2; }
+	dRV_table = (RV_max - RV_min) / (double)(N_RV_table - 1);
+
+	A_table.resize(N_RV_table * NBANDS);
+	for(unsigned int k=0; k<N_RV_table; k++) {
+		double RV_k = (k == N_RV_table - 1) ? RV_max : RV_min + k * dRV_table;
+		for(unsigned int i=0; i<NBANDS; i++) {
+			A_table[NBANDS*k + i] = gsl_spline_eval(A_spl[i], RV_k, NULL);
+		}
+	}
 }
 
 TExtinctionModel::~TExtinctionModel() {
 	for(unsigned int i=0; i<NBANDS; i++) {
 		gsl_spline_free(A_spl[i]);
-		gsl_interp_accel_free(acc[i]);
 	}
 	delete[] A_spl;
-	delete[] acc;
 }
 
-double TExtinctionModel::get_A(double RV, unsigned int i) {
+double TExtinctionModel::get_A(double RV, unsigned int i) const {
 	if(!in_model(RV)) { return std::numeric_limits<double>::quiet_NaN(); }
-	return gsl_spline_eval(A_spl[i], RV, acc[i]);
+	// No accelerator is used, since the same model is shared by many threads
+	return gsl_spline_eval(A_spl[i], RV, NULL);
+}
+
+void TExtinctionModel::get_A(double RV, double *A) const {
+	if(!in_model(RV)) {
+		for(unsigned int i=0; i<NBANDS; i++) {
+			A[i] = std::numeric_limits<double>::quiet_NaN();
+		}
+		return;
+	}
+
+	// Interpolate linearly between the tabulated values
+	double x = (RV - RV_min) / dRV_table;
+	unsigned int k = (unsigned int)x;
+	if(k >= N_RV_table - 1) { k = N_RV_table - 2; }
+	double a = x - (double)k;
+
+	const double *A0 = &(A_table[NBANDS*k]);
+	const double *A1 = A0 + NBANDS;
+	for(unsigned int i=0; i<NBANDS; i++) {
+		A[i] = (1. - a) * A0[i] + a * A1[i];
+	}
 }
 
-bool TExtinctionModel::in_model(double RV) {
+bool TExtinctionModel::in_model(double RV) const {
 	return (RV >= RV_min) && (RV <= RV_max);
 }
 
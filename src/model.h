@@ -181,13 +181,19 @@ public:
 	TExtinctionModel(std::string A_RV_fname);
 	~TExtinctionModel();
 
-	double get_A(double RV, unsigned int i);	// Get A_i(EBV=1), where i is a bandpass
-	bool in_model(double RV);
+	double get_A(double RV, unsigned int i) const;	// Get A_i(EBV=1), where i is a bandpass
+	void get_A(double RV, double *A) const;		// Get A_i(EBV=1) for all NBANDS bandpasses
+	bool in_model(double RV) const;
 
 private:
 	double RV_min, RV_max;
 	gsl_spline **A_spl;
-	gsl_interp_accel **acc;
+
+	// A_i(EBV=1) tabulated on a fine, regular grid in R_V, for fast
+	// lookup of the whole extinction vector. Read-only once built.
+	double dRV_table;
+	unsigned int N_RV_table;
+	std::vector<double> A_table;	// N_RV_table x NBANDS
 };
 
 // Luminosity function
@@ -313,6 +319,19 @@ public:
 	double log_prior_emp(double DM, double Mr, double FeH) const;
 	double log_prior_emp(const double* x) const;
 
+	// Tabulate log_prior_emp on a dense grid in DM, for each of a fixed
+	// set of metallicities (e.g., those of a template library), so that
+	// it can be looked up cheaply. The prior does not depend on Mr.
+	void init_log_prior_emp_table(const std::vector<double>& FeH);
+	bool has_log_prior_emp_table() const;
+
+	// log_prior_emp for the metallicity FeH[FeH_idx] passed to
+	// init_log_prior_emp_table, for <n> values at once. Falls back on
+	// the direct calculation outside the tabulated DM range. The table
+	// must have been built first.
+	void log_prior_emp_table(const double* DM, const unsigned int* FeH_idx,
+	                         unsigned int n, double* log_prior) const;
+
 	// Expected dust reddening, up to normalizing constant
 	double dA_dmu(double DM) const;
 
@@ -334,6 +353,12 @@ private:
 	double DM_min, DM_max, DM_samples, log_dNdmu_norm;
 	TLinearInterp *log_dNdmu_arr, *f_halo_arr, *mu_FeH_disk_arr;
 
+	// Tabulated log_prior_emp (see init_log_prior_emp_table)
+	std::vector<double> FeH_table;
+	std::vector<double> log_prior_table;	// FeH-major: N_FeH x N_DM_table
+	double DM_table_min, inv_dDM_table;
+	unsigned int N_DM_table;
+
 	void init(double _l, double _b);
 
 	// Stellar density
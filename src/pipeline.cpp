@@ -0,0 +1,308 @@
+/*
+ * pipeline.cpp
+ *
+ * Overlaps file I/O with computation: photometry for upcoming pixels
+ * is read ahead of time, and output is written to disk on a
+ * background thread. Also orders pixels and predicts their run times.
+ *
+ * This file is part of bayestar.
+ * Copyright 2012 Gregory Green
+ *
+ * Bayestar is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include "pipeline.h"
+
+
+/*************************************************************************
+ *   Background writer
+ *************************************************************************/
+
+TWriteQueue::TWriteQueue(size_t max_pending)
+	: max_pending_(max_pending), n_running(0), stop(false)
+{
+	worker = std::thread(&TWriteQueue::run, this);
+}
+
+TWriteQueue::~TWriteQueue() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	job_added.notify_all();
+	worker.join();
+}
+
+void TWriteQueue::push(const std::function<void()> &job,
+                       const std::string &pix_name) {
+	std::unique_lock<std::mutex> lock(mtx);
+	if(max_pending_ != 0) {
+		job_done.wait(lock, [this]() { return jobs.size() < max_pending_; });
+	}
+	jobs.push_back(std::make_pair(job, pix_name));
+	lock.unlock();
+
+	job_added.notify_one();
+}
+
+void TWriteQueue::flush() {
+	std::unique_lock<std::mutex> lock(mtx);
+	job_done.wait(lock, [this]() { return jobs.empty() && (n_running == 0); });
+}
+
+bool TWriteQueue::failed(const std::string &pix_name) {
+	std::lock_guard<std::mutex> lock(mtx);
+	return failed_pix.count(pix_name) != 0;
+}
+
+void TWriteQueue::run() {
+	std::unique_lock<std::mutex> lock(mtx);
+
+	while(true) {
+		job_added.wait(lock, [this]() { return stop || !jobs.empty(); });
+
+		// Remaining jobs are finished before stopping
+		if(jobs.empty()) { break; }
+
+		std::function<void()> job = jobs.front().first;
+		std::string pix_name = jobs.front().second;
+		jobs.pop_front();
+		n_running++;
+		lock.unlock();
+
+		// Errors are not allowed to escape the writer thread
+		bool ok = true;
+		try {
+			job();
+		} catch(const H5::Exception &err) {
+			std::cerr << "! Error writing output for " << pix_name << ": "
+			          << err.getDetailMsg() << std::endl;
+			ok = false;
+		} catch(const std::exception &err) {
+			std::cerr << "! Error writing output for " << pix_name << ": "
+			          << err.what() << std::endl;
+			ok = false;
+		}
+
+		lock.lock();
+		if(!ok) { failed_pix.insert(pix_name); }
+		n_running--;
+		job_done.notify_all();
+	}
+}
+
+
+std::string group_pixel_name(const std::string &group) {
+	size_t start = (!group.empty() && (group[0] == '/')) ? 1 : 0;
+	size_t end = group.find('/', start);
+	if(end == std::string::npos) { end = group.size(); }
+	return group.substr(start, end-start);
+}
+
+
+void queue_pixel_complete(TWriteQueue *queue, const std::string &fname,
+                          const std::string &pix_name) {
+	if(queue == NULL) {
+		append_pixel_manifest(fname, pix_name);
+		H5Utils::flush_session();
+		return;
+	}
+
+	// Runs after all of the pixel's other jobs, so their failures
+	// have been recorded
+	queue->push([queue, fname, pix_name]() {
+		if(queue->failed(pix_name)) {
+			std::cerr << "! Not marking " << pix_name << " as complete, "
+			          << "since some of its output was not written." << std::endl;
+		} else {
+			append_pixel_manifest(fname, pix_name);
+		}
+		H5Utils::flush_session();
+	}, pix_name);
+}
+
+
+/*************************************************************************
+ *   Pixel scheduling
+ *************************************************************************/
+
+void order_pixels_largest_first(std::vector<std::string> &pix_name,
+                                std::vector<size_t> &n_stars) {
+	assert(pix_name.size() == n_stars.size());
+
+	std::vector<size_t> order(pix_name.size());
+	for(size_t i=0; i<order.size(); i++) { order[i] = i; }
+	std::stable_sort(order.begin(), order.end(),
+		[&n_stars](size_t a, size_t b) { return n_stars[a] > n_stars[b]; }
+	);
+
+	std::vector<std::string> pix_name_sorted;
+	std::vector<size_t> n_stars_sorted;
+	pix_name_sorted.reserve(order.size());
+	n_stars_sorted.reserve(order.size());
+	for(std::vector<size_t>::const_iterator it = order.begin(); it != order.end(); ++it) {
+		pix_name_sorted.push_back(pix_name[*it]);
+		n_stars_sorted.push_back(n_stars[*it]);
+	}
+
+	pix_name.swap(pix_name_sorted);
+	n_stars.swap(n_stars_sorted);
+}
+
+
+TPixelCostModel::TPixelCostModel(const std::vector<size_t> &n_stars)
+	: n_stars_(n_stars), done(n_stars.size(), false), n_done(0),
+	  sum_x(0.), sum_y(0.), sum_xx(0.), sum_xy(0.)
+{}
+
+void TPixelCostModel::add_measurement(size_t idx, double t) {
+	std::lock_guard<std::mutex> lock(mtx);
+	assert(idx < done.size());
+
+	if(done[idx]) { return; }
+	done[idx] = true;
+	n_done++;
+
+	double x = n_stars_[idx];
+	sum_x += x;
+	sum_y += t;
+	sum_xx += x*x;
+	sum_xy += x*t;
+}
+
+void TPixelCostModel::get_coeffs(double &t_0, double &t_star) const {
+	double n = n_done;
+	double det = n*sum_xx - sum_x*sum_x;
+
+	t_0 = 0.;
+	t_star = 0.;
+
+	if((n_done >= 2) && (det > 1.e-10 * n*sum_xx)) {
+		t_star = (n*sum_xy - sum_x*sum_y) / det;
+		t_0 = (sum_y - t_star*sum_x) / n;
+	}
+
+	// Fall back on a constant time per star if the fit is
+	// unconstrained or unphysical
+	if((t_star <= 0.) || (t_0 < 0.)) {
+		t_0 = 0.;
+		t_star = (sum_x > 0.) ? sum_y / sum_x : 0.;
+	}
+}
+
+double TPixelCostModel::predict(size_t idx) const {
+	std::lock_guard<std::mutex> lock(mtx);
+	if(n_done == 0) { return -1.; }
+
+	double t_0, t_star;
+	get_coeffs(t_0, t_star);
+
+	return t_0 + t_star * n_stars_[idx];
+}
+
+double TPixelCostModel::predict_remaining(unsigned int n_workers) const {
+	std::lock_guard<std::mutex> lock(mtx);
+	if(n_done == 0) { return -1.; }
+	if(n_workers < 1) { n_workers = 1; }
+
+	double t_0, t_star;
+	get_coeffs(t_0, t_star);
+
+	// With greedy scheduling, the run can finish no sooner than the
+	// longest remaining pixel, and no sooner than the total remaining
+	// work spread evenly over the workers. Pixels in progress are
+	// counted in full.
+	double t_sum = 0.;
+	double t_max = 0.;
+	for(size_t i=0; i<n_stars_.size(); i++) {
+		if(done[i]) { continue; }
+		double t = t_0 + t_star * n_stars_[i];
+		t_sum += t;
+		if(t > t_max) { t_max = t; }
+	}
+
+	return std::max(t_sum / (double)n_workers, t_max);
+}
+
+size_t TPixelCostModel::n_remaining() const {
+	std::lock_guard<std::mutex> lock(mtx);
+	return n_stars_.size() - n_done;
+}
+
+
+/*************************************************************************
+ *   Photometry prefetcher
+ *************************************************************************/
+
+TPixelPrefetcher::TPixelPrefetcher(const std::string &input_fname,
+                                   const std::vector<std::string> &pix_name,
+                                   double err_floor, size_t n_ahead)
+	: input_fname_(input_fname), pix_name_(pix_name), err_floor_(err_floor),
+	  n_ahead_(std::max(n_ahead, (size_t)1)), next_load(0), n_taken(0), stop(false)
+{
+	worker = std::thread(&TPixelPrefetcher::run, this);
+}
+
+TPixelPrefetcher::~TPixelPrefetcher() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	pixel_taken.notify_all();
+	worker.join();
+}
+
+std::unique_ptr<TStellarData> TPixelPrefetcher::get(size_t idx) {
+	assert(idx < pix_name_.size());
+
+	std::unique_lock<std::mutex> lock(mtx);
+	pixel_loaded.wait(lock, [this, idx]() { return loaded.count(idx) != 0; });
+
+	std::unique_ptr<TStellarData> data = std::move(loaded[idx]);
+	loaded.erase(idx);
+	n_taken++;
+	lock.unlock();
+
+	pixel_taken.notify_all();
+
+	return data;
+}
+
+void TPixelPrefetcher::run() {
+	std::unique_lock<std::mutex> lock(mtx);
+
+	while(next_load < pix_name_.size()) {
+		pixel_taken.wait(lock, [this]() {
+			return stop || (next_load < n_taken + n_ahead_);
+		});
+		if(stop) { break; }
+
+		size_t idx = next_load;
+		lock.unlock();
+
+		// Reading from the input file is serialized with all other
+		// HDF5 access through H5Utils::io_mutex
+		std::unique_ptr<TStellarData> data(
+			new TStellarData(input_fname_, pix_name_[idx], err_floor_)
+		);
+
+		lock.lock();
+		loaded[idx] = std::move(data);
+		next_load++;
+		pixel_loaded.notify_all();
+	}
+}
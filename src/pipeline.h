@@ -0,0 +1,231 @@
+/*
+ * pipeline.h
+ *
+ * Overlaps file I/O with computation: photometry for upcoming pixels
+ * is read ahead of time, and output is written to disk on a
+ * background thread. Also orders pixels and predicts their run times.
+ *
+ * This file is part of bayestar.
+ * Copyright 2012 Gregory Green
+ *
+ * Bayestar is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _PIPELINE_H__
+#define _PIPELINE_H__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cassert>
+
+#include "h5utils.h"
+#include "manifest.h"
+#include "data.h"
+
+
+/*************************************************************************
+ *   Background writer
+ *************************************************************************/
+
+// Runs write jobs, in the order they were queued, on a single
+// background thread. Jobs must own (or share ownership of) everything
+// they write, since the caller moves on as soon as the job is queued.
+class TWriteQueue {
+public:
+	// If <max_pending> is nonzero, push() blocks while that many
+	// jobs are waiting, which limits the memory held by the queue.
+	TWriteQueue(size_t max_pending = 0);
+	~TWriteQueue();	// Finishes all queued jobs
+
+	// Queue <job>, which writes output for pixel <pix_name>. If the
+	// job throws, the error is logged, and the pixel is marked as failed.
+	void push(const std::function<void()> &job,
+	          const std::string &pix_name);
+
+	// Block until every job queued so far has been written
+	void flush();
+
+	// True if any job for <pix_name> has failed
+	bool failed(const std::string &pix_name);
+
+private:
+	std::thread worker;
+	std::mutex mtx;
+	std::condition_variable job_added, job_done;
+	std::deque<std::pair<std::function<void()>, std::string> > jobs;
+	std::set<std::string> failed_pix;
+	size_t max_pending_;
+	size_t n_running;
+	bool stop;
+
+	void run();
+};
+
+
+// Name of the pixel that owns an output group: the first component of
+// <group>, which may or may not start with "/".
+std::string group_pixel_name(const std::string &group);
+
+
+// Write a chain or image buffer to <fname>. If <queue> is NULL, the
+// buffer is written immediately. Otherwise, the write is handed to the
+// background writer, which keeps the buffer alive until it is done.
+template<class TBuffer>
+void queue_write(TWriteQueue *queue, const std::shared_ptr<TBuffer> &buffer,
+                 const std::string &fname, const std::string &group,
+                 const std::string &dset) {
+	if(queue == NULL) {
+		buffer->write(fname, group, dset);
+		return;
+	}
+
+	queue->push([buffer, fname, group, dset]() {
+		buffer->write(fname, group, dset);
+	}, group_pixel_name(group));
+}
+
+
+// Add a watermark (see H5Utils::add_watermark), either immediately or
+// on the background writer. Watermarks that already exist are left
+// untouched.
+template<class T>
+void queue_watermark(TWriteQueue *queue, const std::string &fname,
+                     const std::string &group, const std::string &attribute,
+                     const T &value) {
+	auto job = [fname, group, attribute, value]() {
+		try {
+			H5Utils::add_watermark<T>(fname, group, attribute, value);
+		} catch(H5::AttributeIException err_att_exists) { }
+	};
+
+	if(queue == NULL) {
+		job();
+	} else {
+		queue->push(job, group_pixel_name(group));
+	}
+}
+
+
+// Record pixel as complete in the output file's manifest (see
+// manifest.h), either immediately or on the background writer. Since
+// jobs run in order, this happens after all of the pixel's previously
+// queued output has been written. If any of that output failed to
+// write, the pixel is left out of the manifest, so that it is rerun
+// when the job is resumed. The output session (see
+// H5Utils::TFileSession), if any, is then flushed to disk.
+void queue_pixel_complete(TWriteQueue *queue, const std::string &fname,
+                          const std::string &pix_name);
+
+
+/*************************************************************************
+ *   Pixel scheduling
+ *************************************************************************/
+
+// Put pixels in largest-first order (by # of stars), so that when
+// several pixels run concurrently, the largest ones do not start last
+// and run alone at the end. Ties keep their original order.
+void order_pixels_largest_first(std::vector<std::string> &pix_name,
+                                std::vector<size_t> &n_stars);
+
+// Predicts the run time of each pixel from its # of stars, using a
+// linear model,
+//     t = t_0 + t_star * (# of stars),
+// fitted by least squares to the run times of completed pixels. The #
+// of regions and clouds are fixed for a run, so their cost is absorbed
+// into t_star. Thread-safe.
+class TPixelCostModel {
+public:
+	TPixelCostModel(const std::vector<size_t> &n_stars);
+
+	// Record the measured run time of pixel <idx>
+	void add_measurement(size_t idx, double t);
+
+	// Predicted run time of pixel <idx>. Negative if no pixels have
+	// been measured yet.
+	double predict(size_t idx) const;
+
+	// Predicted wall time until all unfinished pixels are done, when
+	// <n_workers> pixels run at a time. Negative if no pixels have been
+	// measured yet.
+	double predict_remaining(unsigned int n_workers) const;
+
+	size_t n_remaining() const;
+
+private:
+	std::vector<size_t> n_stars_;
+	std::vector<bool> done;
+	size_t n_done;
+
+	// Running sums for the least-squares fit
+	double sum_x, sum_y, sum_xx, sum_xy;
+
+	mutable std::mutex mtx;
+
+	void get_coeffs(double &t_0, double &t_star) const;
+};
+
+
+/*************************************************************************
+ *   Photometry prefetcher
+ *************************************************************************/
+
+// Loads the photometry of each pixel in <pix_name>, in order, on a
+// background thread, staying at most <n_ahead> pixels ahead of the
+// pixels that have been handed out with get(). Pixels should be
+// requested in roughly increasing order, and <n_ahead> must be at
+// least the number of threads calling get().
+class TPixelPrefetcher {
+public:
+	TPixelPrefetcher(const std::string &input_fname,
+	                 const std::vector<std::string> &pix_name,
+	                 double err_floor, size_t n_ahead);
+	~TPixelPrefetcher();
+
+	// Take ownership of the photometry of pixel <idx>, blocking until
+	// it has been loaded. Each pixel may only be requested once.
+	std::unique_ptr<TStellarData> get(size_t idx);
+
+private:
+	std::string input_fname_;
+	std::vector<std::string> pix_name_;
+	double err_floor_;
+	size_t n_ahead_;
+
+	std::thread worker;
+	std::mutex mtx;
+	std::condition_variable pixel_loaded, pixel_taken;
+	std::map<size_t, std::unique_ptr<TStellarData> > loaded;
+	size_t next_load;	// Index of next pixel to load
+	size_t n_taken;		// # of pixels handed out
+	bool stop;
+
+	void run();
+};
+
+
+#endif // _PIPELINE_H__
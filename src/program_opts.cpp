@@ -20,6 +20,7 @@ TProgramOpts::TProgramOpts() {
 
     synthetic = false;
     sample_stars = false;
+    parallel_stars = false;
     star_steps = 1000;
     star_samplers = 5;
     star_p_replacement = 0.2;
@@ -40,6 +41,8 @@ TProgramOpts::TProgramOpts() {
 
 	discrete_los = false;
 	discrete_steps = 10000;
+	discrete_temperatures = 1;
+	discrete_beta_min = 0.01;
 
     N_regions = 30;
     los_steps = 4000;
@@ -63,6 +66,12 @@ TProgramOpts::TProgramOpts() {
 
     N_runs = 4;
     N_threads = 1;
+    N_pixel_threads = 1;
+
+    shard_index = 0;
+    N_shards = 1;
+
+    pixel_order = "largest-first";
 
     clobber = false;
 
@@ -80,6 +89,7 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
 	namespace po = boost::program_options;
 
 	std::string config_fname = "NONE";
+	std::string shard_str = "";
 
 	po::options_description config_desc("Configuration-file options");
 	config_desc.add_options()
@@ -94,6 +104,9 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
         ("sample-stars",
             "Use MCMC to calculate individual stellar posteriors, "
                 "rather than approximate grid evaluation.")
+        ("parallel-stars",
+            "With --sample-stars, sample stars in parallel (one star "
+                "per thread), rather than parallelizing each star's runs.")
 		("star-steps",
             po::value<unsigned int>(&(opts.star_steps)),
             ("# of MCMC steps per star (per sampler) (default: " +
@@ -156,6 +169,17 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
             ("# of steps to take for the discrete l.o.s. sampler "
                 "(default: " +
                 to_string(opts.discrete_steps) + ")").c_str())
+		("discrete-temperatures",
+            po::value<unsigned int>(&(opts.discrete_temperatures)),
+            ("# of temperatures to use for parallel tempering in the "
+                "discrete l.o.s. sampler. 1 turns tempering off "
+                "(default: " +
+                to_string(opts.discrete_temperatures) + ")").c_str())
+		("discrete-beta-min",
+            po::value<double>(&(opts.discrete_beta_min)),
+            ("Inverse temperature of the hottest chain in the discrete "
+                "l.o.s. sampler, when tempering (default: " +
+                to_string(opts.discrete_beta_min) + ")").c_str())
 
 		("regions",
             po::value<unsigned int>(&(opts.N_regions)),
@@ -372,6 +396,13 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
             "Output HDF5 filename (MCMC output and smoothed "
                 "probability surfaces)")
 
+		("shard",
+            po::value<std::string>(&shard_str),
+            "Process only one shard of the input pixels, given as\n"
+            "k/N, with 0 <= k < N. Pixels are divided among the N\n"
+            "shards so that each has a similar number of stars.\n"
+            "Merge the outputs with bayestar_merge.")
+
 		("config",
             po::value<std::string>(&config_fname),
             "Configuration file containing additional options.")
@@ -394,6 +425,16 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
             po::value<unsigned int>(&(opts.N_threads)),
             ("# of threads to run on (default: " +
                 to_string(opts.N_threads) + ")").c_str())
+		("pixel-threads",
+            po::value<unsigned int>(&(opts.N_pixel_threads)),
+            ("# of pixels to process concurrently. The threads\n"
+                "are divided evenly between pixels (default: " +
+                to_string(opts.N_pixel_threads) + ")").c_str())
+		("pixel-order",
+            po::value<std::string>(&(opts.pixel_order)),
+            ("Order in which to process pixels: 'largest-first'\n"
+                "(most stars first) or 'input' (default: " +
+                opts.pixel_order + ")").c_str())
 	;
 
 	po::positional_options_description pd;
@@ -448,6 +489,7 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
 
 	if(vm.count("synthetic")) { opts.synthetic = true; }
     if(vm.count("sample-stars")) { opts.sample_stars = true; }
+    if(vm.count("parallel-stars")) { opts.parallel_stars = true; }
 	if(vm.count("save-surfs")) { opts.save_surfs = true; }
 	if(vm.count("no-stellar-priors")) { opts.star_priors = false; }
 	if(vm.count("use-gaia")) { opts.use_gaia = true; }
@@ -489,6 +531,42 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
 		return -1;
 	}
 
+	if(opts.N_threads < 1) {
+		cerr << "'threads' must be at least 1." << endl;
+		return -1;
+	}
+	if((opts.N_pixel_threads < 1) || (opts.N_pixel_threads > opts.N_threads)) {
+		cerr << "'pixel-threads' must be between 1 and 'threads'." << endl;
+		return -1;
+	}
+
+	if((opts.pixel_order != "largest-first") && (opts.pixel_order != "input")) {
+		cerr << "'pixel-order' must be 'largest-first' or 'input'." << endl;
+		return -1;
+	}
+
+	if(shard_str != "") {
+		char slash;
+		int k, N;
+		std::istringstream shard_ss(shard_str);
+		if(!(shard_ss >> k >> slash >> N) || (slash != '/')
+		   || !shard_ss.eof() || (N < 1) || (k < 0) || (k >= N)) {
+			cerr << "'shard' must be of the form k/N, with 0 <= k < N." << endl;
+			return -1;
+		}
+		opts.shard_index = k;
+		opts.N_shards = N;
+	}
+
+	if(opts.discrete_temperatures < 1) {
+		cerr << "'discrete-temperatures' must be at least 1." << endl;
+		return -1;
+	}
+	if((opts.discrete_beta_min <= 0.) || (opts.discrete_beta_min > 1.)) {
+		cerr << "'discrete-beta-min' must be in the range (0, 1]." << endl;
+		return -1;
+	}
+
 	if(opts.N_regions != 0) {
 		if(120 % (opts.N_regions) != 0) {
 			cerr << "# of regions in extinction profile must divide "
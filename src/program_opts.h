@@ -6,6 +6,7 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
 
 #include <boost/program_options.hpp>
 
@@ -26,6 +27,7 @@ struct TProgramOpts {
 
 	bool synthetic;
     bool sample_stars;
+    bool parallel_stars;
 	unsigned int star_steps;
 	unsigned int star_samplers;
 	double star_p_replacement;
@@ -44,6 +46,8 @@ struct TProgramOpts {
 
 	bool discrete_los;
 	unsigned int discrete_steps;
+	unsigned int discrete_temperatures;
+	double discrete_beta_min;
 
 	unsigned int N_regions;
 	unsigned int los_steps;
@@ -67,6 +71,12 @@ struct TProgramOpts {
 
 	unsigned int N_runs;
 	unsigned int N_threads;
+	unsigned int N_pixel_threads;    // # of pixels to process concurrently
+
+	unsigned int shard_index;        // Process only shard <shard_index> ...
+	unsigned int N_shards;           // ... of <N_shards> (see --shard)
+
+	string pixel_order;              // "largest-first" or "input"
 
 	bool clobber;
 
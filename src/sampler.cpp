@@ -55,6 +55,24 @@ TMCMCParams::TMCMCParams(TGalacticLOSModel *_gal_model, TSyntheticStellarModel *
 	use_priors = true;
 }
 
+// Copies share the models and data, but get their own E(B-V) curve, so
+// that each copy can be used by a different thread.
+TMCMCParams::TMCMCParams(const TMCMCParams& other)
+	: synth_stellar_model(other.synth_stellar_model), emp_stellar_model(other.emp_stellar_model),
+	  gal_model(other.gal_model), ext_model(other.ext_model),
+	  EBV_SFD(other.EBV_SFD), EBV_floor(other.EBV_floor),
+	  DM_min(other.DM_min), DM_max(other.DM_max), N_DM(other.N_DM), N_stars(other.N_stars),
+	  data(other.data), lnp0(other.lnp0),
+	  EBV_min(other.EBV_min), EBV_max(other.EBV_max), idx_star(other.idx_star),
+	  vary_RV(other.vary_RV), RV_mean(other.RV_mean), RV_variance(other.RV_variance),
+	  use_priors(other.use_priors)
+{
+	EBV_interp = new TLinearInterp(DM_min, DM_max, N_DM);
+	for(unsigned int i=0; i<N_DM; i++) {
+		(*EBV_interp)[i] = (*other.EBV_interp)[i];
+	}
+}
+
 TMCMCParams::~TMCMCParams() {
 	delete EBV_interp;
 }
@@ -105,11 +123,14 @@ double logP_single_star_synth(const double *x, double EBV, double RV,
 		return neg_inf_replacement;
 	}
 
+	double A[NBANDS];
+	ext_model.get_A(RV, A);
+
 	double logL = 0.;
 	double tmp;
 	for(unsigned int i=0; i<NBANDS; i++) {
 		if(d.err[i] < 1.e9) {
-			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * ext_model.get_A(RV, i);	// Model apparent magnitude
+			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * A[i];	// Model apparent magnitude
 			logL -= log( 1. + exp((tmp - d.maglimit[i]) / d.maglim_width[i]) );
 			//logL += log( 0.5 - 0.5 * erf((tmp - d.maglimit[i] + 0.1) / 0.25) );	// Completeness fraction
 			tmp = (d.m[i] - tmp) / d.err[i];
@@ -163,11 +184,14 @@ double logP_single_star_emp(const double *x, double EBV, double RV,
 		return neg_inf_replacement;
 	}
 
+	double A[NBANDS];
+	ext_model.get_A(RV, A);
+
 	double logL = 0.;
 	double tmp;
 	for(unsigned int i=0; i<NBANDS; i++) {
 		if(d.err[i] < 1.e9) {
-			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * ext_model.get_A(RV, i);	// Model apparent magnitude
+			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * A[i];	// Model apparent magnitude
 			logL -= log( 1. + exp((tmp - d.maglimit[i]) / d.maglim_width[i]) );
 			//logL += log( 0.5 - 0.5 * erf((tmp - d.maglimit[i] + 0.1) / 0.25) );	// Completeness fraction
 			//std::cout << tmp << ", " << d.maglimit[i] << std::endl;
@@ -209,11 +233,14 @@ double logP_single_star_emp_noprior(const double *x, double EBV, double RV,
 		return neg_inf_replacement;
 	}
 
+	double A[NBANDS];
+	ext_model.get_A(RV, A);
+
 	double logL = 0.;
 	double tmp;
 	for(unsigned int i=0; i<NBANDS; i++) {
 		if(d.err[i] < 1.e9) {
-			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * ext_model.get_A(RV, i);	// Model apparent magnitude
+			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * A[i];	// Model apparent magnitude
 			tmp = (d.m[i] - tmp) / d.err[i];
 			logL -= 0.5*tmp*tmp;
 		}
@@ -682,9 +709,12 @@ void gen_rand_state_indiv_emp(double *const x, unsigned int N, gsl_rng *r, TMCMC
 	double reddened_mag, obs_mag, maglim;
 	double max_DM = inf_replacement;
 
+	double A[NBANDS];
+	params.ext_model->get_A(RV, A);
+
 	for(int i=0; i<NBANDS; i++) {
 		sigma = params.data->star[params.idx_star].err[i];
-		reddened_mag = tmp_sed->absmag[i] + x[0] * params.ext_model->get_A(RV, i);
+		reddened_mag = tmp_sed->absmag[i] + x[0] * A[i];
 		obs_mag = params.data->star[params.idx_star].m[i];
 		maglim = params.data->star[params.idx_star].maglimit[i];
 		if(obs_mag > maglim) {
@@ -787,7 +817,8 @@ double logP_indiv_simple_emp(const double *x, unsigned int N, TMCMCParams &param
 void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalacticLOSModel& galactic_model,
                         TSyntheticStellarModel& stellar_model, TExtinctionModel& extinction_model, TStellarData& stellar_data,
                         TImgStack& img_stack, std::vector<bool> &conv, std::vector<double> &lnZ,
-                        double RV_sigma, double minEBV, const bool saveSurfs, const bool gatherSurfs, int verbosity) {
+                        double RV_sigma, double minEBV, const bool saveSurfs, const bool gatherSurfs, int verbosity,
+                        TWriteQueue *write_queue) {
 	// Parameters must be consistent - cannot save surfaces without gathering them
 	assert(!(saveSurfs & (!gatherSurfs)));
 
@@ -812,8 +843,8 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
 		img_stack.set_rect(rect);
 	}
 
-	TImgWriteBuffer *imgBuffer = NULL;
-	if(saveSurfs) { imgBuffer = new TImgWriteBuffer(rect, params.N_stars); }
+	std::shared_ptr<TImgWriteBuffer> imgBuffer;
+	if(saveSurfs) { imgBuffer = std::make_shared<TImgWriteBuffer>(rect, params.N_stars); }
 
 	TNullLogger logger;
 
@@ -825,7 +856,6 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
 
 	if(params.vary_RV) { ndim = 6; } else { ndim = 5; }
 
-	double *GR = new double[ndim];
 	double GR_threshold = 1.1;
 
 	TAffineSampler<TMCMCParams, TNullLogger>::pdf_t f_pdf = &logP_indiv_simple_synth;
@@ -837,24 +867,51 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
 
 	unsigned int N_nonconv = 0;
 
-	TChainWriteBuffer chainBuffer(ndim, 100, params.N_stars);
+	// Each star has a preallocated output slot, so that stars can be
+	// finished in any order.
+	std::shared_ptr<TChainWriteBuffer> chainBuffer = std::make_shared<TChainWriteBuffer>(ndim, 100, params.N_stars);
+	chainBuffer->resize(params.N_stars);
+	std::vector<char> conv_star(params.N_stars, 0);
+	std::vector<double> lnZ_star(params.N_stars, 0.);
+
 	std::stringstream group_name;
 	group_name << "/" << stellar_data.pix_name;
 
-	timespec t_start, t_write, t_end;
+	int n_star_threads = options.parallel_stars ? omp_get_max_threads() : 1;
+	// Seeds for the threads are drawn from one generator, so that they
+	// are distinct even if the threads are seeded at the same time
+	gsl_rng *r_seed;
+	seed_gsl_rng(&r_seed);
+	std::vector<gsl_rng*> r_subsample(n_star_threads);
+	for(int k=0; k<n_star_threads; k++) {
+		r_subsample[k] = gsl_rng_alloc(gsl_rng_taus);
+		gsl_rng_set(r_subsample[k], gsl_rng_get(r_seed));
+	}
+	gsl_rng_free(r_seed);
 
+	#pragma omp parallel for schedule(dynamic) num_threads(n_star_threads) reduction(+:N_nonconv)
 	for(size_t n=0; n<params.N_stars; n++) {
-		params.idx_star = n;
+		// The runs of each star's sampler are executed within this task
+		if(n_star_threads > 1) { omp_set_num_threads(1); }
+
+		TMCMCParams star_params(params);
+		star_params.idx_star = n;
+
+		std::vector<double> GR(ndim);
+		timespec t_start, t_write, t_end;
 
 		clock_gettime(CLOCK_MONOTONIC, &t_start);
 
 		if(verbosity >= 2) {
+			#pragma omp critical (cout)
+			{
 			std::cout << "Star #" << n+1 << " of " << params.N_stars << std::endl;
 			std::cout << "====================================" << std::endl;
+			}
 		}
 
 		//std::cerr << "# Setting up sampler" << std::endl;
-		TParallelAffineSampler<TMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
+		TParallelAffineSampler<TMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, star_params, logger, N_runs);
 		sampler.set_scale(1.2);
 		sampler.set_replacement_bandwidth(0.2);
 		sampler.set_sigma_min(0.02);
@@ -870,7 +927,7 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
 			sampler.step((1<<attempt)*N_steps, true, 0., 0.2);
 
 			converged = true;
-			sampler.get_GR_diagnostic(GR);
+			sampler.get_GR_diagnostic(GR.data());
 			for(size_t i=0; i<ndim; i++) {
 				if(GR[i] > GR_threshold) {
 					converged = false;
@@ -891,42 +948,54 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
 		//if(isinf(lnZ_tmp)) { lnZ_tmp = neg_inf_replacement; }
 
 		// Save thinned chain
-		chainBuffer.add(chain, converged, lnZ_tmp, GR);
+		chainBuffer->set(n, chain, r_subsample[omp_get_thread_num()], converged, lnZ_tmp, GR.data());
 
 		// Save binned p(DM, EBV) surface
 		if(gatherSurfs) {
 			chain.get_image(*(img_stack.img[n]), rect, 0, 1, true, 1.0, 1.0, 30., true);
 		}
-		if(saveSurfs) { imgBuffer->add(*(img_stack.img[n])); }
 
-		lnZ.push_back(lnZ_tmp);
-		conv.push_back(converged);
+		lnZ_star[n] = lnZ_tmp;
+		conv_star[n] = converged;
 
 		clock_gettime(CLOCK_MONOTONIC, &t_end);
 
-		//std::cout << "Sampler stats:" << std::endl;
+		if(!converged) { N_nonconv++; }
+
 		if(verbosity >= 2) {
+			#pragma omp critical (cout)
+			{
+			//std::cout << "Sampler stats:" << std::endl;
 			sampler.print_stats();
 			std::cout << std::endl;
-		}
 
-		if(!converged) {
-			N_nonconv++;
-			if(verbosity >= 2) {
+			if(!converged) {
 				std::cout << "# Failed to converge." << std::endl;
 			}
-		}
 
-		if(verbosity >= 2) {
 			std::cout << "# Number of steps: " << (1<<(attempt-1))*N_steps << std::endl;
 			std::cout << "# Time elapsed: " << std::setprecision(2) << (t_end.tv_sec - t_start.tv_sec) + 1.e-9*(t_end.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
 			std::cout << "# Sample time: " << std::setprecision(2) << (t_write.tv_sec - t_start.tv_sec) + 1.e-9*(t_write.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
 			std::cout << "# Write time: " << std::setprecision(2) << (t_end.tv_sec - t_write.tv_sec) + 1.e-9*(t_end.tv_nsec - t_write.tv_nsec) << " s" << std::endl << std::endl;
+			}
 		}
 	}
 
-	chainBuffer.write(out_fname, group_name.str(), "stellar chains");
-	if(saveSurfs) { imgBuffer->write(out_fname, group_name.str(), "stellar pdfs"); }
+	for(int k=0; k<n_star_threads; k++) { gsl_rng_free(r_subsample[k]); }
+
+	for(size_t n=0; n<params.N_stars; n++) {
+		lnZ.push_back(lnZ_star[n]);
+		conv.push_back(conv_star[n]);
+	}
+
+	if(saveSurfs) {
+		for(size_t n=0; n<params.N_stars; n++) {
+			imgBuffer->add(*(img_stack.img[n]));
+		}
+	}
+
+	queue_write(write_queue, chainBuffer, out_fname, group_name.str(), "stellar chains");
+	if(saveSurfs) { queue_write(write_queue, imgBuffer, out_fname, group_name.str(), "stellar pdfs"); }
 
 	if(verbosity >= 1) {
 		std::cout << "====================================" << std::endl;
@@ -936,15 +1005,13 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
 		std::cout << "====================================" << std::endl;
 	}
 
-	if(imgBuffer != NULL) { delete imgBuffer; }
-	delete[] GR;
 }
 
 void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLOSModel& galactic_model,
                       TStellarModel& stellar_model, TExtinctionModel& extinction_model, TEBVSmoothing& EBV_smoothing,
 					  TStellarData& stellar_data, TImgStack& img_stack, std::vector<bool> &conv, std::vector<double> &lnZ,
                       double RV_mean, double RV_sigma, double minEBV, const bool saveSurfs, const bool gatherSurfs, const bool use_priors,
-                      int verbosity) {
+                      int verbosity, TWriteQueue *write_queue) {
 	// Parameters must be consistent - cannot save surfaces without gathering them
 	assert(!(saveSurfs & (!gatherSurfs)));
 
@@ -972,8 +1039,8 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 		img_stack.resize(params.N_stars);
 		img_stack.set_rect(rect);
 	}
-	TImgWriteBuffer *imgBuffer = NULL;
-	if(saveSurfs) { imgBuffer = new TImgWriteBuffer(rect, params.N_stars); }
+	std::shared_ptr<TImgWriteBuffer> imgBuffer;
+	if(saveSurfs) { imgBuffer = std::make_shared<TImgWriteBuffer>(rect, params.N_stars); }
 
 	unsigned int max_attempts = 3;
 	unsigned int N_steps = options.steps;
@@ -983,31 +1050,56 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 
 	if(params.vary_RV) { ndim = 5; } else { ndim = 4; }
 
-	double *GR = new double[ndim];
 	double GR_threshold = 1.1;
 
 	TNullLogger logger;
 	TAffineSampler<TMCMCParams, TNullLogger>::pdf_t f_pdf = &logP_indiv_simple_emp;
 	TAffineSampler<TMCMCParams, TNullLogger>::rand_state_t f_rand_state = &gen_rand_state_indiv_emp;
 
-	timespec t_start, t_write, t_end;
-
 	if(verbosity >= 1) {
 		std::cout << std::endl;
 	}
 
 	unsigned int N_nonconv = 0;
 
-	TChainWriteBuffer chainBuffer(ndim, 100, params.N_stars);
+	// Each star has a preallocated output slot, so that stars can be
+	// finished in any order.
+	std::shared_ptr<TChainWriteBuffer> chainBuffer = std::make_shared<TChainWriteBuffer>(ndim, 100, params.N_stars);
+	chainBuffer->resize(params.N_stars);
+	std::vector<char> conv_star(params.N_stars, 0);
+	std::vector<double> lnZ_star(params.N_stars, 0.);
+
 	std::stringstream group_name;
 	group_name << "/" << stellar_data.pix_name;
 
+	int n_star_threads = options.parallel_stars ? omp_get_max_threads() : 1;
+	// Seeds for the threads are drawn from one generator, so that they
+	// are distinct even if the threads are seeded at the same time
+	gsl_rng *r_seed;
+	seed_gsl_rng(&r_seed);
+	std::vector<gsl_rng*> r_subsample(n_star_threads);
+	for(int k=0; k<n_star_threads; k++) {
+		r_subsample[k] = gsl_rng_alloc(gsl_rng_taus);
+		gsl_rng_set(r_subsample[k], gsl_rng_get(r_seed));
+	}
+	gsl_rng_free(r_seed);
+
+	#pragma omp parallel for schedule(dynamic) num_threads(n_star_threads) reduction(+:N_nonconv)
 	for(size_t n=0; n<params.N_stars; n++) {
-		params.idx_star = n;
+		// The runs of each star's sampler are executed within this task
+		if(n_star_threads > 1) { omp_set_num_threads(1); }
+
+		TMCMCParams star_params(params);
+		star_params.idx_star = n;
+
+		std::vector<double> GR(ndim);
+		timespec t_start, t_write, t_end;
 
 		clock_gettime(CLOCK_MONOTONIC, &t_start);
 
 		if(verbosity >= 2) {
+			#pragma omp critical (cout)
+			{
 			std::cout << "Star #" << n+1 << " of " << params.N_stars << std::endl;
 			std::cout << "====================================" << std::endl;
 
@@ -1026,10 +1118,11 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 				std::cout << std::setprecision(3) << params.data->star[n].maglimit[i] << " ";
 			}
 			std::cout << std::endl << std::endl;
+			}
 		}
 
 		//std::cerr << "# Setting up sampler" << std::endl;
-		TParallelAffineSampler<TMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
+		TParallelAffineSampler<TMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, star_params, logger, N_runs);
 		sampler.set_scale(1.5);
 		sampler.set_replacement_bandwidth(0.30);
 		sampler.set_replacement_accept_bias(1.e-5);
@@ -1043,12 +1136,13 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 		sampler.step_MH(N_steps*(1./6.), false);
 		sampler.step(N_steps*(2./6.), false, 0., options.p_replacement);
 
+		std::stringstream scale_log;
 		if(verbosity >= 2) {
-			std::cout << std::endl;
-			std::cout << "scale: (";
-			std::cout << std::setprecision(2);
+			scale_log << std::endl;
+			scale_log << "scale: (";
+			scale_log << std::setprecision(2);
 			for(int k=0; k<sampler.get_N_samplers(); k++) {
-				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+				scale_log << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
 			}
 		}
 
@@ -1062,11 +1156,11 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 		sampler.tune_MH(6, 0.30);
 
 		if(verbosity >= 2) {
-			std::cout << ") -> (";
+			scale_log << ") -> (";
 			for(int k=0; k<sampler.get_N_samplers(); k++) {
-				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+				scale_log << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
 			}
-			std::cout << ")" << std::endl;
+			scale_log << ")" << std::endl;
 		}
 
 		// Round 2 (3/6)
@@ -1075,10 +1169,10 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 		sampler.step(N_steps*(2./6.), false, 0., options.p_replacement);
 
 		if(verbosity >= 2) {
-			std::cout << "scale: (";
-			std::cout << std::setprecision(2);
+			scale_log << "scale: (";
+			scale_log << std::setprecision(2);
 			for(int k=0; k<sampler.get_N_samplers(); k++) {
-				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+				scale_log << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
 			}
 		}
 
@@ -1086,12 +1180,12 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 		sampler.tune_MH(6, 0.30);
 
 		if(verbosity >= 2) {
-			std::cout << ") -> (";
+			scale_log << ") -> (";
 			for(int k=0; k<sampler.get_N_samplers(); k++) {
-				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+				scale_log << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
 			}
-			std::cout << ")" << std::endl;
-			std::cout << std::endl;
+			scale_log << ")" << std::endl;
+			scale_log << std::endl;
 		}
 
 		sampler.clear();
@@ -1106,7 +1200,7 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 			//sampler.step_MH((1<<attempt)*N_steps*(1./3.), true);
 
 			converged = true;
-			sampler.get_GR_diagnostic(GR);
+			sampler.get_GR_diagnostic(GR.data());
 			for(size_t i=0; i<ndim; i++) {
 				if(GR[i] > GR_threshold) {
 					converged = false;
@@ -1127,39 +1221,48 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 		//if(isinf(lnZ_tmp)) { lnZ_tmp = neg_inf_replacement; }
 
 		// Save thinned chain
-		chainBuffer.add(chain, converged, lnZ_tmp, GR);
+		chainBuffer->set(n, chain, r_subsample[omp_get_thread_num()], converged, lnZ_tmp, GR.data());
 
 		// Save binned p(DM, EBV) surface
 		if(gatherSurfs) {
 			chain.get_image(*(img_stack.img[n]), rect, 0, 1, true, 1.0, 1.0, 30., true);
 		}
 
-		lnZ.push_back(lnZ_tmp);
-		conv.push_back(converged);
+		lnZ_star[n] = lnZ_tmp;
+		conv_star[n] = converged;
 
 		clock_gettime(CLOCK_MONOTONIC, &t_end);
 
+		if(!converged) { N_nonconv++; }
+
 		if(verbosity >= 2) {
+			#pragma omp critical (cout)
+			{
+			std::cout << scale_log.str();
+
 			sampler.print_stats();
 			std::cout << std::endl;
-		}
 
-		if(!converged) {
-			N_nonconv++;
-			if(verbosity >= 2) {
+			if(!converged) {
 				std::cout << "# Failed to converge." << std::endl;
 			}
-		}
 
-		if(verbosity >= 2) {
 			std::cout << "# Number of steps: " << (1<<(attempt-1))*N_steps << std::endl;
-			std::cout << "# ln Z: " << lnZ.back() << std::endl;
+			std::cout << "# ln Z: " << lnZ_tmp << std::endl;
 			std::cout << "# Time elapsed: " << std::setprecision(2) << (t_end.tv_sec - t_start.tv_sec) + 1.e-9*(t_end.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
 			std::cout << "# Sample time: " << std::setprecision(2) << (t_write.tv_sec - t_start.tv_sec) + 1.e-9*(t_write.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
 			std::cout << "# Write time: " << std::setprecision(2) << (t_end.tv_sec - t_write.tv_sec) + 1.e-9*(t_end.tv_nsec - t_write.tv_nsec) << " s" << std::endl << std::endl;
+			}
 		}
 	}
 
+	for(int k=0; k<n_star_threads; k++) { gsl_rng_free(r_subsample[k]); }
+
+	for(size_t n=0; n<params.N_stars; n++) {
+		lnZ.push_back(lnZ_star[n]);
+		conv.push_back(conv_star[n]);
+	}
+
 	// Smooth the individual stellar surfaces along E(B-V) axis, with
 	// kernel that varies with E(B-V).
 	if(EBV_smoothing.get_pct_smoothing_max() > 0.) {
@@ -1175,8 +1278,8 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 		}
 	}
 
-	chainBuffer.write(out_fname, group_name.str(), "stellar chains");
-	if(saveSurfs) { imgBuffer->write(out_fname, group_name.str(), "stellar pdfs"); }
+	queue_write(write_queue, chainBuffer, out_fname, group_name.str(), "stellar chains");
+	if(saveSurfs) { queue_write(write_queue, imgBuffer, out_fname, group_name.str(), "stellar pdfs"); }
 
 	if(verbosity >= 1) {
 		if(verbosity >= 2) {
@@ -1190,8 +1293,6 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 		}
 	}
 
-	if(imgBuffer != NULL) { delete imgBuffer; }
-	delete[] GR;
 }
 
 
@@ -73,6 +73,7 @@ struct TMCMCParams {
 				TExtinctionModel* _ext_model,
                 TStellarData* _data,
 				unsigned int _N_DM, double _DM_min, double _DM_max);
+	TMCMCParams(const TMCMCParams& other);
 	~TMCMCParams();
 
 	// Model
@@ -128,13 +129,14 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
                         TSyntheticStellarModel& stellar_model,TExtinctionModel& extinction_model, TStellarData& stellar_data,
                         TImgStack& img_stack, std::vector<bool> &conv, std::vector<double> &lnZ,
                         double RV_sigma=-1., double minEBV=0., const bool saveSurfs=false, const bool gatherSurfs=true,
-                        int verbosity=1);
+                        int verbosity=1, TWriteQueue *write_queue=NULL);
 
 void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLOSModel& galactic_model,
                       TStellarModel& stellar_model, TExtinctionModel& extinction_model, TEBVSmoothing& EBV_smoothing,
                       TStellarData& stellar_data, TImgStack& img_stack, std::vector<bool> &conv, std::vector<double> &lnZ,
                       double RV_mean=3.1, double RV_sigma=-1., double minEBV=0., const bool saveSurfs=false,
-                      const bool gatherSurfs=true, const bool use_priors=true, int verbosity=1);
+                      const bool gatherSurfs=true, const bool use_priors=true, int verbosity=1,
+                      TWriteQueue *write_queue=NULL);
 
 #ifdef _USE_PARALLEL_TEMPERING__
 void sample_indiv_emp_pt(
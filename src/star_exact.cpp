@@ -40,22 +40,25 @@ LinearFitParams::LinearFitParams(unsigned int n_dim)
  * Grid evaluation of stellar parameters (E, \mu, M_r, [Fe/H])
  */
 
+// Templates are left off a star's surface if, together, they could carry
+// at most this fraction of the surface's (unsmoothed) mass
+const double GRID_PRUNE_TOL = 1.e-8;
+
+
 void star_covariance(TStellarData::TMagnitudes& mags_obs,
-                     TExtinctionModel& ext_model,
-                     double& inv_cov_00, double& inv_cov_01, double& inv_cov_11,
-                     double RV) {
+                     const double* A,
+                     double& inv_cov_00, double& inv_cov_01, double& inv_cov_11) {
     // Various useful terms
     double inv_sigma2 = 0.;         // 1 / sigma_i^2
     double A_over_sigma2 = 0.;      // A_i / sigma_i^2
     double A2_over_sigma2 = 0.;     // A_i^2 / sigma_i^2
 
     for(int i=0; i<NBANDS; i++) {
-        double A = ext_model.get_A(RV, i);
         double ivar = 1. / (mags_obs.err[i] * mags_obs.err[i]);
 
         inv_sigma2 += ivar;
-        A_over_sigma2 += A * ivar;
-        A2_over_sigma2 += A*A * ivar;
+        A_over_sigma2 += A[i] * ivar;
+        A2_over_sigma2 += A[i]*A[i] * ivar;
     }
 
     // Set the inverse covariance terms
@@ -65,21 +68,19 @@ void star_covariance(TStellarData::TMagnitudes& mags_obs,
 }
 
 void star_max_likelihood(TSED& mags_model, TStellarData::TMagnitudes& mags_obs,
-                         TExtinctionModel& ext_model,
+                         const double* A,
                          double inv_cov_00, double inv_cov_01, double inv_cov_11,
-                         double& mu, double& E, double& chi2,
-                         double RV) {
+                         double& mu, double& E, double& chi2) {
     // Various useful terms
     double dm_over_sigma2 = 0.;     // (m_i - M_i) / sigma_i^2
     double dm_A_over_sigma2 = 0.;   // (m_i - M_i) A_i / sigma_i^2
 
     for(int i=0; i<NBANDS; i++) {
-        double A = ext_model.get_A(RV, i);
         double ivar = 1. / (mags_obs.err[i] * mags_obs.err[i]);
         double dm = mags_obs.m[i] - mags_model.absmag[i];
 
         dm_over_sigma2 += dm * ivar;
-        dm_A_over_sigma2 += dm * A * ivar;
+        dm_A_over_sigma2 += dm * A[i] * ivar;
     }
 
     double mu_0 = dm_over_sigma2 / inv_cov_00;
@@ -98,31 +99,146 @@ void star_max_likelihood(TSED& mags_model, TStellarData::TMagnitudes& mags_obs,
     chi2 = 0.;
 
     for(int i=0; i<NBANDS; i++) {
-        double A = ext_model.get_A(RV, i);
         double ivar = 1. / (mags_obs.err[i] * mags_obs.err[i]);
         double dm = mags_obs.m[i] - mags_model.absmag[i];
 
-        double delta = (dm - E * A - mu);
+        double delta = (dm - E * A[i] - mu);
 
         chi2 += delta*delta * ivar;
     }
 }
 
+
+TSEDGrid::TSEDGrid(TStellarModel& stellar_model) {
+    unsigned int N_Mr = stellar_model.get_N_Mr();
+    unsigned int N_FeH = stellar_model.get_N_FeH();
+
+    std::vector<TSED> seds;
+    seds.reserve(N_Mr*N_FeH);
+    Mr.reserve(N_Mr*N_FeH);
+    FeH.reserve(N_Mr*N_FeH);
+    log_lf.reserve(N_Mr*N_FeH);
+    FeH_idx.reserve(N_Mr*N_FeH);
+    FeH_values.resize(N_FeH, std::numeric_limits<double>::quiet_NaN());
+
+    TSED sed;
+    double Mr_tmp, FeH_tmp;
+
+    for(int Mr_idx=0; Mr_idx<N_Mr; Mr_idx++) {
+        for(int FeH_idx_tmp=0; FeH_idx_tmp<N_FeH; FeH_idx_tmp++) {
+            bool success = stellar_model.get_sed(Mr_idx, FeH_idx_tmp, sed, Mr_tmp, FeH_tmp);
+            if(!success) {
+                std::cerr << "SED (" << Mr_idx << ", " << FeH_idx_tmp
+                          << ") not in library!" << std::endl;
+                continue;
+            }
+
+            seds.push_back(sed);
+            Mr.push_back(Mr_tmp);
+            FeH.push_back(FeH_tmp);
+            log_lf.push_back(stellar_model.get_log_lf(Mr_tmp));
+            FeH_idx.push_back(FeH_idx_tmp);
+            FeH_values[FeH_idx_tmp] = FeH_tmp;
+        }
+    }
+
+    // Transpose to band-major order
+    n_templates = seds.size();
+    absmag.resize(NBANDS * n_templates);
+
+    for(int i=0; i<NBANDS; i++) {
+        for(unsigned int t=0; t<n_templates; t++) {
+            absmag[i*n_templates + t] = seds[t].absmag[i];
+        }
+    }
+}
+
+void star_max_likelihood_grid(const TSEDGrid& grid,
+                              TStellarData::TMagnitudes& mags_obs,
+                              const double* A,
+                              double* mu, double* E, double* chi2) {
+    const unsigned int N = grid.n_templates;
+
+    // Terms that depend only on the star, not the template
+    double ivar[NBANDS];
+    double inv_cov_00 = 0.;         // 1 / sigma_i^2
+    double inv_cov_01 = 0.;         // A_i / sigma_i^2
+    double inv_cov_11 = 0.;         // A_i^2 / sigma_i^2
+    double m_over_sigma2 = 0.;      // m_i / sigma_i^2
+    double m_A_over_sigma2 = 0.;    // m_i A_i / sigma_i^2
+
+    for(int i=0; i<NBANDS; i++) {
+        ivar[i] = 1. / (mags_obs.err[i] * mags_obs.err[i]);
+
+        inv_cov_00 += ivar[i];
+        inv_cov_01 += A[i] * ivar[i];
+        inv_cov_11 += A[i]*A[i] * ivar[i];
+        m_over_sigma2 += mags_obs.m[i] * ivar[i];
+        m_A_over_sigma2 += mags_obs.m[i] * A[i] * ivar[i];
+    }
+
+    double C_01 = inv_cov_01 / inv_cov_00;
+    double C_10 = inv_cov_01 / inv_cov_11;
+    double C_det_inv = 1. / (1. - C_01 * C_10);
+
+    // Accumulate M_i / sigma_i^2 and M_i A_i / sigma_i^2 in the output
+    // arrays for (mu, E), one band at a time
+    std::fill(mu, mu+N, 0.);
+    std::fill(E, E+N, 0.);
+
+    for(int i=0; i<NBANDS; i++) {
+        const double* M = &(grid.absmag[i*N]);
+        double w = ivar[i];
+        double w_A = A[i] * ivar[i];
+
+        #pragma omp simd
+        for(unsigned int t=0; t<N; t++) {
+            mu[t] += w * M[t];
+            E[t] += w_A * M[t];
+        }
+    }
+
+    // Compute maximum-likelihood (mu, E) using the formula
+    //   (1 + C) (mu E)^T = (mu_0 E_0)^T
+    #pragma omp simd
+    for(unsigned int t=0; t<N; t++) {
+        double mu_0 = (m_over_sigma2 - mu[t]) / inv_cov_00;
+        double E_0 = (m_A_over_sigma2 - E[t]) / inv_cov_11;
+        mu[t] = C_det_inv * (mu_0 - C_01 * E_0);
+        E[t]  = C_det_inv * (E_0  - C_10 * mu_0);
+    }
+
+    // Compute best chi^2 by plugging in ML (mu, E)
+    std::fill(chi2, chi2+N, 0.);
+
+    for(int i=0; i<NBANDS; i++) {
+        const double* M = &(grid.absmag[i*N]);
+        double m = mags_obs.m[i];
+        double a = A[i];
+        double w = ivar[i];
+
+        #pragma omp simd
+        for(unsigned int t=0; t<N; t++) {
+            double delta = m - M[t] - E[t] * a - mu[t];
+            chi2[t] += delta*delta * w;
+        }
+    }
+}
+
 // Calculate the chi^2 of a given stellar fit, parameterized by
 // (spectral energy distribution, distance modulus, reddening),
 // with a given reddening -> extinction mapping.
 double calc_star_chi2(TStellarData::TMagnitudes& mags_obs,
-                      TExtinctionModel& ext_model,
+                      const double* A,
                       TSED& mags_model,
-                      double mu, double E, double RV) {
+                      double mu, double E) {
     double chi2 = 0.;
 
     for(int i=0; i<NBANDS; i++) {
-        double A = ext_model.get_A(RV, i);
         double ivar = 1. / (mags_obs.err[i] * mags_obs.err[i]);
         double dm = mags_obs.m[i] - mags_model.absmag[i];
 
-        double delta = (dm - E * A - mu);
+        double delta = (dm - E * A[i] - mu);
 
         chi2 += delta*delta * ivar;
     }
@@ -134,8 +250,7 @@ double calc_star_chi2(TStellarData::TMagnitudes& mags_obs,
 std::shared_ptr<LinearFitParams> star_max_likelihood(
         TSED& mags_model,
         TStellarData::TMagnitudes& mags_obs,
-        TExtinctionModel& ext_model,
-        double RV) {
+        const double* A) {
     // Create empty return class
     std::shared_ptr<LinearFitParams> ret = std::make_shared<LinearFitParams>(2);
 
@@ -147,15 +262,14 @@ std::shared_ptr<LinearFitParams> star_max_likelihood(
     double dm_A_over_sigma2 = 0.;   // (m_i - M_i) A_i / sigma_i^2
 
     for(int i=0; i<NBANDS; i++) {
-        double A = ext_model.get_A(RV, i);
         double ivar = 1. / (mags_obs.err[i] * mags_obs.err[i]);
         double dm = mags_obs.m[i] - mags_model.absmag[i];
 
         inv_sigma2 += ivar;
-        A_over_sigma2 += A * ivar;
-        A2_over_sigma2 += A*A * ivar;
+        A_over_sigma2 += A[i] * ivar;
+        A2_over_sigma2 += A[i]*A[i] * ivar;
         dm_over_sigma2 += dm * ivar;
-        dm_A_over_sigma2 += dm * A * ivar;
+        dm_A_over_sigma2 += dm * A[i] * ivar;
     }
 
     double mu_0 = dm_over_sigma2 / inv_sigma2;
@@ -182,11 +296,10 @@ std::shared_ptr<LinearFitParams> star_max_likelihood(
     double chi2 = 0.;
 
     for(int i=0; i<NBANDS; i++) {
-        double A = ext_model.get_A(RV, i);
         double ivar = 1. / (mags_obs.err[i] * mags_obs.err[i]);
         double dm = mags_obs.m[i] - mags_model.absmag[i];
 
-        double delta = (dm - E * A - mu);
+        double delta = (dm - E * A[i] - mu);
 
         chi2 += delta*delta * ivar;
     }
@@ -198,7 +311,7 @@ std::shared_ptr<LinearFitParams> star_max_likelihood(
 
 
 void gaussian_filter(std::shared_ptr<LinearFitParams> p,
-                     TRect& grid, cv::Mat& img,
+                     const TRect& grid, cv::Mat& img,
                      double n_sigma, int min_width) {
     // Determine sigma along each axis
     double det = p->inv_cov(0,0) * p->inv_cov(1,1) - p->inv_cov(0,1) * p->inv_cov(1,0) + 1.e-5;
@@ -243,7 +356,7 @@ void gaussian_filter(std::shared_ptr<LinearFitParams> p,
 
 
 void gaussian_filter(double inv_cov_00, double inv_cov_01, double inv_cov_11,
-                     TRect& grid, cv::Mat& img,
+                     const TRect& grid, cv::Mat& img,
                      double n_sigma, int min_width,
                      double add_diagonal=-1.,
                      int subsample=5, int verbosity=0) {
@@ -359,133 +472,241 @@ double integrate_ML_solution(TStellarModel& stellar_model,
                              bool use_priors,
 			     bool use_gaia,
                              double RV, int verbosity) {
-    //
-    TSED sed;
-    unsigned int N_Mr = stellar_model.get_N_Mr();
-    unsigned int N_FeH = stellar_model.get_N_FeH();
-    double Mr, FeH;
+    TSEDGrid sed_grid(stellar_model);
+    TGridEvalWorkspace ws;
+    return integrate_ML_solution(sed_grid, los_model, mags_obs,
+                                 ext_model, img_stack, img_idx,
+                                 use_priors, use_gaia, RV, ws,
+                                 verbosity);
+}
 
-    // std::cerr << "N_Mr = " << N_Mr << std::endl;
-    // std::cerr << "N_FeH = " << N_FeH << std::endl;
+// Decide whether smooth_sparse will be faster than cv::filter2D, for an
+// image with <n_nonzero> non-zero pixels. filter2D costs ~ (kernel area)
+// operations per pixel for small kernels, but switches to a DFT-based
+// method for large kernels, which costs ~ (a few dozen) operations per
+// pixel. smooth_sparse costs (kernel area) operations per non-zero pixel.
+bool use_sparse_smoothing(const cv::Mat& img, size_t n_nonzero, const cv::Mat& kernel) {
+    double kernel_area = (double)kernel.rows * (double)kernel.cols;
+    double cost_sparse = (double)n_nonzero * kernel_area;
+    double cost_dense = (double)img.rows * (double)img.cols * std::min(kernel_area, 50.);
+    return cost_sparse < cost_dense;
+}
 
+// Smooth an image that is mostly zero with the given kernel, by adding a
+// weighted copy of the kernel around each non-zero pixel. <nonzero> holds
+// the flat indices of the non-zero pixels, without duplicates. The result
+// is added to <dst>, which covers the window of the image beginning at
+// (offset_0, offset_1). Gives the same result as cv::filter2D with
+// cv::BORDER_CONSTANT: pixels beyond the edge of the image are zero.
+void smooth_sparse(const cv::Mat& img, const std::vector<int>& nonzero,
+                   const cv::Mat& kernel, cv::Mat& dst,
+                   int offset_0, int offset_1) {
+    // filter2D computes dst(x) = sum_k kernel(k) img(x + k - anchor).
+    // Shift the anchor to account for the window.
+    int anchor_0 = kernel.rows / 2 - offset_0;
+    int anchor_1 = kernel.cols / 2 - offset_1;
+
+    for(std::vector<int>::const_iterator it = nonzero.begin(); it != nonzero.end(); ++it) {
+        int j0 = *it / img.cols;
+        int j1 = *it % img.cols;
+        floating_t v = img.at<floating_t>(j0, j1);
+        if(v == 0) { continue; }
+
+        // Range of kernel rows/columns that land inside the window
+        int k0_min = std::max(0, j0 + anchor_0 - (dst.rows - 1));
+        int k0_max = std::min(kernel.rows - 1, j0 + anchor_0);
+        int k1_min = std::max(0, j1 + anchor_1 - (dst.cols - 1));
+        int k1_max = std::min(kernel.cols - 1, j1 + anchor_1);
+
+        for(int k0=k0_min; k0<=k0_max; k0++) {
+            const floating_t* kernel_row = kernel.ptr<floating_t>(k0);
+            floating_t* dst_row = dst.ptr<floating_t>(j0 + anchor_0 - k0);
+            int offset = j1 + anchor_1;
+
+            #pragma omp simd
+            for(int k1=k1_min; k1<=k1_max; k1++) {
+                dst_row[offset - k1] += v * kernel_row[k1];
+            }
+        }
+    }
+}
+
+// Turn the ML (mu, E) and chi^2 of every template into the star's
+// probability surface: add each template's solution to the image,
+// weighted by likelihood and prior, and smooth the image with the
+// covariance of the ML solution. Returns min. chi^2 / passband.
+//
+// The solutions are placed on <eval_rect>, which may extend beyond the
+// stack's rect (with the same pixel size), so that points just outside
+// the final surface still spread into it when smoothed. The result is
+// written straight into the stack's (compact) image.
+
+double splat_ML_solution(const TSEDGrid& sed_grid,
+                         TGalacticLOSModel& los_model,
+                         TStellarData::TMagnitudes& mags_obs,
+                         const double* A,
+                         const TRect& eval_rect,
+                         TImgStack& img_stack,
+                         unsigned int img_idx,
+                         bool use_priors,
+                         bool use_gaia,
+                         const double* mu_ML,
+                         const double* E_ML,
+                         const double* chi2_ML,
+                         TGridEvalWorkspace& ws,
+                         int verbosity) {
     // Calculate covariance of ML solution for (mu, E)
     double inv_cov_00, inv_cov_01, inv_cov_11;
 
-    star_covariance(mags_obs, ext_model,
-                    inv_cov_00, inv_cov_01, inv_cov_11,
-                    RV);
+    star_covariance(mags_obs, A,
+                    inv_cov_00, inv_cov_01, inv_cov_11);
 
     if (!img_stack.initialize_to_zero(img_idx)) {
         std::cerr << "Failed to initialize image to zero!" << std::endl;
     }
 
-    // Arrays holding ML (E, mu), chi2 and prior
-    std::vector<double> E_ML;
-    std::vector<double> mu_ML;
-    std::vector<double> chi2_ML;
-    std::vector<double> prior_ML;
-
-    unsigned int N_reserve = N_Mr*N_FeH + 1;
-    E_ML.reserve(N_reserve);
-    mu_ML.reserve(N_reserve);
-    chi2_ML.reserve(N_reserve);
-    prior_ML.reserve(N_reserve);
-
-    for(int Mr_idx=0; Mr_idx<N_Mr; Mr_idx++) {
-        for(int FeH_idx=0; FeH_idx<N_FeH; FeH_idx++) {
-            // Look up model absolute magnitudes of this stellar type
-            bool success = stellar_model.get_sed(Mr_idx, FeH_idx, sed, Mr, FeH);
-            if(!success) {
-                std::cerr << "SED (" << Mr_idx << ", " << FeH_idx
-                          << ") not in library!" << std::endl;
-                continue;
+    unsigned int N_templates = sed_grid.n_templates;
+    std::vector<double>& prior_ML = ws.prior_ML;
+    prior_ML.resize(N_templates);
+
+    if(use_priors) {
+        if(los_model.has_log_prior_emp_table()) {
+            los_model.log_prior_emp_table(mu_ML, sed_grid.FeH_idx.data(),
+                                          N_templates, prior_ML.data());
+        } else {
+            for(unsigned int k=0; k<N_templates; k++) {
+                prior_ML[k] = los_model.log_prior_emp(mu_ML[k], sed_grid.Mr[k], sed_grid.FeH[k]);
             }
+        }
 
-            // std::cerr << "Mr check: " << Mr << " == " << sed.absmag[1] << std::endl;
-
-            // Calculate max. likelihood solution for (mu, E) given this fixed stellar type
-            double mu, E, chi2;
-            star_max_likelihood(sed, mags_obs, ext_model,
-                                inv_cov_00, inv_cov_01, inv_cov_11,
-                                mu, E, chi2,
-                                RV);
-
-	    double prior = 0.0;
-	    if(use_priors) {
-	      prior += los_model.log_prior_emp(mu, Mr, FeH) + stellar_model.get_log_lf(Mr);
-	    }
-	    if(use_gaia) {
-              double pi_mu = pow(10., -(mu+5.)/5.);
-	      prior += -0.5 * (mags_obs.pi - pi_mu) * (mags_obs.pi - pi_mu) / (mags_obs.pierr * mags_obs.pierr);
-	    }
-
-
-            // std::cerr << "p(FeH = " << FeH << ") = " << prior << std::endl;
-
-            E_ML.push_back(E);
-            mu_ML.push_back(mu);
-            chi2_ML.push_back(chi2);
-            prior_ML.push_back(prior);
-
+        #pragma omp simd
+        for(unsigned int k=0; k<N_templates; k++) {
+            prior_ML[k] += sed_grid.log_lf[k];
+        }
+    } else {
+        std::fill(prior_ML.begin(), prior_ML.end(), 0.);
+    }
 
+    if(use_gaia) {
+        for(unsigned int k=0; k<N_templates; k++) {
+            double pi_mu = pow(10., -(mu_ML[k]+5.)/5.);
+            prior_ML[k] += -0.5 * (mags_obs.pi - pi_mu) * (mags_obs.pi - pi_mu) / (mags_obs.pierr * mags_obs.pierr);
         }
     }
 
     double prior_max = *std::max_element(prior_ML.begin(), prior_ML.end());
 
-    double chi2_min = *std::min_element(chi2_ML.begin(), chi2_ML.end());
+    double chi2_min = *std::min_element(chi2_ML, chi2_ML + N_templates);
 
     if(verbosity >= 2) {
         std::cerr << "prior_max = " << prior_max << std::endl;
         std::cerr << "chi2_min = " << chi2_min << std::endl;
     }
 
-    assert( E_ML.size() == mu_ML.size() );
-    assert( chi2_ML.size() == mu_ML.size() );
-    assert( prior_ML.size() == mu_ML.size() );
-
     unsigned int img_idx0, img_idx1;
     double a0, a1;
 
-    for(int k=0; k<mu_ML.size(); k++) {
-        // Add single point to image at ML solution location (E, mu)
-        bool in_bounds = img_stack.rect->get_interpolant(
-            E_ML.at(k), mu_ML.at(k),
+    // Offset of the final surface within the evaluation grid
+    const TRect& img_rect = *(img_stack.rect);
+    int offset_0 = (int)round((img_rect.min[0] - eval_rect.min[0]) / eval_rect.dx[0]);
+    int offset_1 = (int)round((img_rect.min[1] - eval_rect.min[1]) / eval_rect.dx[1]);
+
+    // Unsmoothed points are placed on the evaluation grid, kept in the
+    // workspace. Keep track of which pixels are non-zero, for sparse
+    // smoothing, and so that the grid can be cleared cheaply afterwards.
+    cv::Mat& eval_img = ws.eval_img;
+    if((eval_img.rows != (int)eval_rect.N_bins[0]) || (eval_img.cols != (int)eval_rect.N_bins[1])) {
+        eval_img = cv::Mat::zeros(eval_rect.N_bins[0], eval_rect.N_bins[1], CV_FLOATING_TYPE);
+    }
+
+    std::vector<int>& nonzero = ws.nonzero;
+    nonzero.clear();
+
+    // Log weight of each template that lands on the grid
+    std::vector<double>& log_w = ws.log_w;
+    log_w.resize(N_templates);
+    double log_w_max = -std::numeric_limits<double>::infinity();
+    unsigned int n_in_bounds = 0;
+
+    for(unsigned int k=0; k<N_templates; k++) {
+        bool in_bounds = eval_rect.get_interpolant(
+            E_ML[k], mu_ML[k],
             img_idx0, img_idx1,
             a0, a1
         );
 
-        // bool in_bounds = img_stack.rect->get_index(E_ML.at(k), mu_ML.at(k), img_idx0, img_idx1);
-
         if(in_bounds) {
-            double log_p = -0.5 * (chi2_ML.at(k) - chi2_min);
-	    log_p += prior_ML.at(k) - prior_max;
+            log_w[k] = -0.5 * (chi2_ML[k] - chi2_min) + prior_ML[k] - prior_max;
+            if(log_w[k] > log_w_max) { log_w_max = log_w[k]; }
+            n_in_bounds++;
+        } else {
+            log_w[k] = -std::numeric_limits<double>::infinity();
+        }
+    }
 
-            double p = exp(log_p);
+    // Drop templates that are so far down from the best one that, even
+    // all together, they could carry no more than a fraction
+    // GRID_PRUNE_TOL of the mass on the grid:
+    //     N * exp(log_w_max - ln(N / tol)) = tol * exp(log_w_max)
+    double log_w_cut = log_w_max - log((double)std::max(n_in_bounds, 1u) / GRID_PRUNE_TOL);
+    unsigned int n_kept = 0;
 
+    for(unsigned int k=0; k<N_templates; k++) {
+        if(std::isinf(log_w[k]) || (log_w[k] < log_w_cut)) { continue; }
 
-            // Interpolate between bins
-            img_stack.img[img_idx]->at<floating_t>(img_idx0, img_idx1) += (1-a0) * (1-a1) * p;
-            img_stack.img[img_idx]->at<floating_t>(img_idx0+1, img_idx1) += a0 * (1-a1) * p;
-            img_stack.img[img_idx]->at<floating_t>(img_idx0, img_idx1+1) += (1-a0) * a1 * p;
-            img_stack.img[img_idx]->at<floating_t>(img_idx0+1, img_idx1+1) += a0 * a1 * p;
-        }
+        // Add single point to image at ML solution location (E, mu)
+        eval_rect.get_interpolant(
+            E_ML[k], mu_ML[k],
+            img_idx0, img_idx1,
+            a0, a1
+        );
+
+        double p = exp(log_w[k]);
+        n_kept++;
+
+        // Interpolate between bins
+        eval_img.at<floating_t>(img_idx0, img_idx1) += (1-a0) * (1-a1) * p;
+        eval_img.at<floating_t>(img_idx0+1, img_idx1) += a0 * (1-a1) * p;
+        eval_img.at<floating_t>(img_idx0, img_idx1+1) += (1-a0) * a1 * p;
+        eval_img.at<floating_t>(img_idx0+1, img_idx1+1) += a0 * a1 * p;
+
+        int flat_idx = img_idx0 * eval_img.cols + img_idx1;
+        nonzero.push_back(flat_idx);
+        nonzero.push_back(flat_idx + eval_img.cols);
+        nonzero.push_back(flat_idx + 1);
+        nonzero.push_back(flat_idx + eval_img.cols + 1);
     }
 
+    if(verbosity >= 2) {
+        std::cerr << "templates kept: " << n_kept << " of " << n_in_bounds << std::endl;
+    }
+
+    std::sort(nonzero.begin(), nonzero.end());
+    nonzero.erase(std::unique(nonzero.begin(), nonzero.end()), nonzero.end());
+
 
     // Smooth PDF with covariance of the ML solution
-    cv::Mat cov_img;
     gaussian_filter(inv_cov_11, inv_cov_01, inv_cov_00,
-                    *(img_stack.rect), cov_img, 5, 2, 1.0,
+                    eval_rect, ws.cov_img, 5, 2, 1.0,
                     verbosity);
 
-    cv::Mat filtered_img = cv::Mat::zeros(
-        img_stack.rect->N_bins[0],
-        img_stack.rect->N_bins[1],
-        CV_FLOATING_TYPE
-    );
-    cv::filter2D(*img_stack.img[img_idx], filtered_img, CV_FLOATING_TYPE, cov_img);
-    *img_stack.img[img_idx] = filtered_img;
+    cv::Mat& img = *img_stack.img[img_idx];
+
+    if(use_sparse_smoothing(eval_img, nonzero.size(), ws.cov_img)) {
+        smooth_sparse(eval_img, nonzero, ws.cov_img, img, offset_0, offset_1);
+    } else {
+        // Same border as smooth_sparse: nothing beyond the evaluation grid
+        cv::filter2D(eval_img, ws.filtered_img, CV_FLOATING_TYPE, ws.cov_img,
+                     cv::Point(-1,-1), 0, cv::BORDER_CONSTANT);
+        cv::Rect roi(offset_1, offset_0, img.cols, img.rows);
+        ws.filtered_img(roi).copyTo(img);
+    }
+
+    // Clear the evaluation grid for the next star
+    floating_t* eval_data = eval_img.ptr<floating_t>(0);
+    for(std::vector<int>::const_iterator it = nonzero.begin(); it != nonzero.end(); ++it) {
+        eval_data[*it] = 0;
+    }
 
     // Return mininum chi^2 / passband
     int n_passbands = 0;
@@ -504,6 +725,37 @@ double integrate_ML_solution(TStellarModel& stellar_model,
     return chi2_min / n_passbands;
 }
 
+double integrate_ML_solution(const TSEDGrid& sed_grid,
+                             TGalacticLOSModel& los_model,
+                             TStellarData::TMagnitudes& mags_obs,
+                             TExtinctionModel& ext_model,
+                             TImgStack& img_stack,
+                             unsigned int img_idx,
+                             bool use_priors,
+			     bool use_gaia,
+                             double RV,
+                             TGridEvalWorkspace& ws,
+                             int verbosity) {
+    // Extinction vector, looked up once for this star
+    double A[NBANDS];
+    ext_model.get_A(RV, A);
+
+    // Calculate max. likelihood solution for (mu, E) for every stellar type
+    unsigned int N_templates = sed_grid.n_templates;
+    ws.E_ML.resize(N_templates);
+    ws.mu_ML.resize(N_templates);
+    ws.chi2_ML.resize(N_templates);
+
+    star_max_likelihood_grid(sed_grid, mags_obs, A,
+                             ws.mu_ML.data(), ws.E_ML.data(), ws.chi2_ML.data());
+
+    return splat_ML_solution(sed_grid, los_model, mags_obs, A,
+                             *(img_stack.rect), img_stack, img_idx,
+                             use_priors, use_gaia,
+                             ws.mu_ML.data(), ws.E_ML.data(), ws.chi2_ML.data(),
+                             ws, verbosity);
+}
+
 void grid_eval_stars(TGalacticLOSModel& los_model, TExtinctionModel& ext_model,
                      TStellarModel& stellar_model, TStellarData& stellar_data,
                      TEBVSmoothing& EBV_smoothing,
@@ -511,43 +763,78 @@ void grid_eval_stars(TGalacticLOSModel& los_model, TExtinctionModel& ext_model,
                      bool save_surfs, std::string out_fname,
                      bool use_priors,
 		     bool use_gaia,
-                     double RV, int verbosity) {
+                     double RV, int verbosity,
+                     TWriteQueue *write_queue) {
     // TODO: copy in EBV_smoothing from MCMC sampler
 
     // Timing
     auto t_start = std::chrono::steady_clock::now();
 
-    // Set up image stack for stellar PDFs
-    double min[2] = {-0.2,  3.75};   // (E, DM)
-	double max[2] = { 7.2, 19.25};  // (E, DM)
-	unsigned int N_bins[2] = {740, 124};
-	TRect rect(min, max, N_bins);
+    // Set up image stack for stellar PDFs. The solutions are evaluated on
+    // a grid with a margin around the final (E, DM) range, so that points
+    // just outside the range are still smoothed into it, but the images
+    // themselves only cover the final range.
+    double eval_min[2] = {-0.2,  3.75};   // (E, DM)
+    double eval_max[2] = { 7.2, 19.25};  // (E, DM)
+    unsigned int eval_N_bins[2] = {740, 124};
+    TRect eval_rect(eval_min, eval_max, eval_N_bins);
+
+    double min[2] = {0.,  4.};  // (E, DM)
+    double max[2] = {7., 19.};  // (E, DM)
+    unsigned int N_bins[2] = {700, 120};
+    TRect rect(min, max, N_bins);
     img_stack.set_rect(rect);
 
-    // Loop over all stars and evaluate PDFs on grid in (mu, E)
+    // Loop over all stars and evaluate PDFs on grid in (mu, E). Each star
+    // only touches its own image and chi^2 slot, so the stars are
+    // independent, and can be split up between threads.
     int n_stars = stellar_data.star.size();
     chi2.clear();
+    chi2.resize(n_stars);
+
+    TSEDGrid sed_grid(stellar_model);
+    std::vector<TGridEvalWorkspace> workspace(omp_get_max_threads());
 
+    // The l.o.s. prior only has to be evaluated for the library's metallicities
+    if(use_priors) {
+        los_model.init_log_prior_emp_table(sed_grid.FeH_values);
+    }
+
+    // Extinction vector, the same for every star
+    double A[NBANDS];
+    ext_model.get_A(RV, A);
+
+    #pragma omp parallel for schedule(dynamic)
     for(int i=0; i<n_stars; i++) {
+        TGridEvalWorkspace& ws = workspace[omp_get_thread_num()];
+
         if(verbosity >= 2) {
+            #pragma omp critical (cout)
             std::cerr << "Star " << i+1 << " of " << n_stars << std::endl;
         }
 
-        double chi2_min = integrate_ML_solution(
-            stellar_model, los_model,
-            stellar_data[i], ext_model,
-            img_stack, i,
+        // Calculate max. likelihood solution for (mu, E) for every stellar type
+        ws.E_ML.resize(sed_grid.n_templates);
+        ws.mu_ML.resize(sed_grid.n_templates);
+        ws.chi2_ML.resize(sed_grid.n_templates);
+
+        star_max_likelihood_grid(sed_grid, stellar_data[i], A,
+                                 ws.mu_ML.data(), ws.E_ML.data(), ws.chi2_ML.data());
+
+        chi2[i] = splat_ML_solution(
+            sed_grid, los_model,
+            stellar_data[i], A,
+            eval_rect, img_stack, i,
             use_priors,
-	    use_gaia,
-            RV,
+            use_gaia,
+            ws.mu_ML.data(),
+            ws.E_ML.data(),
+            ws.chi2_ML.data(),
+            ws,
             verbosity
         );
-        chi2.push_back(chi2_min);
     }
 
-    // Crop to correct (E, DM) range
-    img_stack.crop(0., 7., 4., 19.);
-
     // Smooth the individual stellar surfaces along E(B-V) axis, with
 	// kernel that varies with E(B-V).
     auto t_smooth = std::chrono::steady_clock::now();
@@ -575,16 +862,16 @@ void grid_eval_stars(TGalacticLOSModel& los_model, TExtinctionModel& ext_model,
         std::stringstream group_name;
         group_name << "/" << stellar_data.pix_name;
 
-        TImgWriteBuffer img_buffer(*(img_stack.rect), n_stars);
+        std::shared_ptr<TImgWriteBuffer> img_buffer = std::make_shared<TImgWriteBuffer>(*(img_stack.rect), n_stars);
 
 		for(int n=0; n<n_stars; n++) {
             // std::cerr << "image[" << n << "].shape = ("
             //           << img_stack.img[n]->rows << ", "
             //           << img_stack.img[n]->cols << ")" << std::endl;
-			img_buffer.add(*(img_stack.img[n]));
+			img_buffer->add(*(img_stack.img[n]));
 		}
 
-        img_buffer.write(out_fname, group_name.str(), "stellar pdfs");
+        queue_write(write_queue, img_buffer, out_fname, group_name.str(), "stellar pdfs");
 	}
 
     auto t_end = std::chrono::steady_clock::now();
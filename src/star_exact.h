@@ -9,6 +9,9 @@
 #include <memory>
 #include <cstdlib>
 #include <chrono>
+#include <vector>
+
+#include <omp.h>
 
 #include <Eigen/Dense>
 
@@ -31,23 +34,67 @@ private:
 };
 
 
+// The solvers below take the extinction vector, A_i(EBV=1) for each of
+// the NBANDS bandpasses (see TExtinctionModel::get_A), which only has
+// to be looked up once per star.
+
 std::shared_ptr<LinearFitParams> star_max_likelihood(
     TSED& mags_model,
     TStellarData::TMagnitudes& mags_obs,
-    TExtinctionModel& ext_model,
-    double RV=3.1);
+    const double* A);
 
 
 void star_covariance(TStellarData::TMagnitudes& mags_obs,
-                     TExtinctionModel& ext_model,
-                     double& inv_cov_00, double& inv_cov_01, double& inv_cov_11,
-                     double RV=3.1);
+                     const double* A,
+                     double& inv_cov_00, double& inv_cov_01, double& inv_cov_11);
 
 void star_max_likelihood(TSED& mags_model, TStellarData::TMagnitudes& mags_obs,
-                         TExtinctionModel& ext_model,
+                         const double* A,
                          double inv_cov_00, double inv_cov_01, double inv_cov_11,
-                         double& mu, double& E, double& chi2,
-                         double RV=3.1);
+                         double& mu, double& E, double& chi2);
+
+// The stellar template library, laid out as a structure of arrays, so
+// that the ML solution for every template can be found in one sweep.
+// Built once, and shared by all stars.
+struct TSEDGrid {
+    unsigned int n_templates;
+
+    std::vector<double> absmag;     // NBANDS x n_templates (band-major)
+    std::vector<double> Mr;
+    std::vector<double> FeH;
+    std::vector<double> log_lf;     // Luminosity function at each Mr
+
+    // Index of each template's [Fe/H] in FeH_values, the library's
+    // distinct metallicities (see TGalacticLOSModel::init_log_prior_emp_table)
+    std::vector<unsigned int> FeH_idx;
+    std::vector<double> FeH_values;
+
+    TSEDGrid(TStellarModel& stellar_model);
+};
+
+// Maximum-likelihood (mu, E), and the corresponding chi^2, of every
+// template in the grid. The output arrays must each hold
+// grid.n_templates elements.
+void star_max_likelihood_grid(const TSEDGrid& grid,
+                              TStellarData::TMagnitudes& mags_obs,
+                              const double* A,
+                              double* mu, double* E, double* chi2);
+
+// Scratch space used by integrate_ML_solution. Holding on to one of
+// these per thread avoids reallocating the buffers for every star.
+struct TGridEvalWorkspace {
+    // ML (E, mu), chi2 and prior of each stellar template
+    std::vector<double> E_ML;
+    std::vector<double> mu_ML;
+    std::vector<double> chi2_ML;
+    std::vector<double> prior_ML;
+    std::vector<double> log_w;      // Weight of each template on the surface
+
+    cv::Mat cov_img;        // Smoothing kernel
+    cv::Mat eval_img;       // Unsmoothed points, on the evaluation grid
+    cv::Mat filtered_img;   // Output of smoothing
+    std::vector<int> nonzero;   // Flat indices of non-zero pixels
+};
 
 double integrate_ML_solution(TStellarModel& stellar_model,
                              TGalacticLOSModel& los_model,
@@ -56,8 +103,21 @@ double integrate_ML_solution(TStellarModel& stellar_model,
                              TImgStack& img_stack,
                              unsigned int img_idx,
                              bool use_priors,
+                             bool use_gaia,
                              double RV, int verbosity);
 
+double integrate_ML_solution(const TSEDGrid& sed_grid,
+                             TGalacticLOSModel& los_model,
+                             TStellarData::TMagnitudes& mags_obs,
+                             TExtinctionModel& ext_model,
+                             TImgStack& img_stack,
+                             unsigned int img_idx,
+                             bool use_priors,
+                             bool use_gaia,
+                             double RV,
+                             TGridEvalWorkspace& ws,
+                             int verbosity);
+
 
 void grid_eval_stars(TGalacticLOSModel& los_model, TExtinctionModel& ext_model,
                      TStellarModel& stellar_model, TStellarData& stellar_data,
@@ -65,7 +125,8 @@ void grid_eval_stars(TGalacticLOSModel& los_model, TExtinctionModel& ext_model,
                      TImgStack& img_stack, std::vector<double>& chi2,
                      bool save_surfs, std::string out_fname,
                      bool use_priors, bool use_gaia,
-                     double RV, int verbosity);
+                     double RV, int verbosity,
+                     TWriteQueue *write_queue=NULL);
 
 
 #endif // _STAR_EXACT_H__